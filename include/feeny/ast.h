@@ -37,8 +37,10 @@ typedef struct {
     AstTag tag;
 } SlotStmt;
 
+// Scope statements carry the source line they start on, 0 when unknown
 typedef struct {
     AstTag tag;
+    int line;
 } ScopeStmt;
 
 typedef struct {
@@ -51,6 +53,7 @@ typedef struct {
     char *format;
     int nexps;
     Exp **exps;
+    struct PrintFormat *compiled; // Chunks of format, built on first evaluation
 } PrintfExp;
 
 typedef struct {
@@ -136,12 +139,14 @@ typedef struct {
 // Scope Statements
 typedef struct {
     AstTag tag;
+    int line;
     char *name;
     Exp *exp;
 } ScopeVar;
 
 typedef struct {
     AstTag tag;
+    int line;
     char *name;
     int nargs;
     char **args;
@@ -150,12 +155,14 @@ typedef struct {
 
 typedef struct {
     AstTag tag;
+    int line;
     ScopeStmt *a;
     ScopeStmt *b;
 } ScopeSeq;
 
 typedef struct {
     AstTag tag;
+    int line;
     Exp *exp;
 } ScopeExp;
 
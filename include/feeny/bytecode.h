@@ -33,13 +33,58 @@ typedef enum {
     BRANCH_OP,
     GOTO_OP,
     RETURN_OP,
-    DROP_OP
+    DROP_OP,
+    // Integer fast paths of binary operators, encoded as CallSlotIns with
+    // arity 2 and falling back to a generic call-slot on non-int operands
+    ADD_INT_OP,
+    SUB_INT_OP,
+    MUL_INT_OP,
+    DIV_INT_OP,
+    MOD_INT_OP,
+    LT_INT_OP,
+    GT_INT_OP,
+    LE_INT_OP,
+    GE_INT_OP,
+    EQ_INT_OP,
+    // Array intrinsics for get/set/length, encoded as CallSlotIns with arity
+    // 2/3/1 and falling back to a generic call-slot on non-array receivers
+    ARRAY_GET_OP,
+    ARRAY_SET_OP,
+    ARRAY_LEN_OP,
+    // Calls in tail position, encoded as CallIns/CallSlotIns. The callee reuses
+    // the caller's frame and returns straight to the caller's return address,
+    // the RETURN_OP after them only runs when a call-slot hits a builtin.
+    TAIL_CALL_OP,
+    TAIL_CALL_SLOT_OP,
+    // Superinstructions, only created by the linker out of the sequences
+    // in their names. The fused instructions stay in place after the first one
+    // and keep their own operands, so jumps into the middle still work.
+    GET_LOCAL_LIT_OP,     // get-local, lit
+    GET_LOCAL_LOCAL_OP,   // get-local, get-local
+    GET_GLOBAL_LOCAL_OP,  // get-global, get-local
+    SET_GET_LOCAL_OP,     // set-local, get-local
+    ADD_LOCAL_LIT_OP,     // get-local, lit, add-int
+    INC_LOCAL_OP,         // get-local, lit, add-int, set-local
+    BR_LT_OP,             // lt-int, branch
+    BR_GT_OP,             // gt-int, branch
+    BR_LE_OP,             // le-int, branch
+    BR_GE_OP,             // ge-int, branch
+    BR_EQ_OP,             // eq-int, branch
+    // Quickened instructions, written over a generic instruction by its first
+    // execution. They keep its operands, so base_opcode maps them back.
+    PUSH_IMM_OP,          // lit, arg holds the tagged literal
+    CALL_DIRECT_OP,       // call, cache holds the resolved function
+    TAIL_CALL_DIRECT_OP,  // tail-call, cache holds the resolved function
+    OPCODE_COUNT // Number of opcodes, not an instruction
 } OpCode;
 
 typedef struct {
     ValTag tag;
 } Value;
 
+// Linked form of a method's code, see linker.h
+typedef struct Instr Instr;
+
 typedef struct {
     ValTag tag;
     int value;
@@ -56,7 +101,13 @@ typedef struct {
     int nargs;
     int nlocals;
     Vector *code;
-    int processed;
+    int *lines;     // Source line of each instruction in code, NULL when unknown
+    Instr *ins;     // Linked instructions, NULL until the program is linked
+    int *ins_lines; // Source line of each linked instruction, NULL when unknown
+    int ninstr;
+    int maxstack;   // Operand stack slots the method needs, computed by the compiler
+    void *jit;      // Native code of the method, NULL until the jit compiles it
+    void *profile;  // Counters of --profile, NULL unless profiling
 } MethodValue;
 
 typedef struct {
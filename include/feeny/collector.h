@@ -8,6 +8,29 @@
 #include <stdio.h>
 #include <sys/mman.h>
 
+/**
+ * Generational copying collector
+ * Objects are bump allocated in the eden of a fixed nursery. When it fills,
+ * a minor collection copies the live young objects into a survivor space and
+ * promotes those that survived TENURE_AGE collections (or do not fit) into
+ * the tenured space. Tenured objects that get a reference to a young object
+ * are recorded in the remembered set by the write barrier, and their slots
+ * are roots of the next minor collection. When the tenured space can not
+ * take a nursery's worth of promotions, a major collection copies everything
+ * live into the other tenured semispace.
+ * Each tenured semispace reserves vm_options.heap_max of address space up
+ * front and commits pages as the heap grows, so growing never moves or copies
+ * objects. After a major collection the heap grows until at most
+ * vm_options.gc_target_occupancy percent of it is live, and gives pages back
+ * once less than half of that is.
+ */
+#define EDEN_SIZE (1024 * 1024)                // Bytes allocated between minor collections
+#define SURVIVOR_SIZE (256 * 1024)             // Bytes of each survivor semispace
+#define TENURE_AGE 2                           // Minor collections survived before promotion
+#define LARGE_OBJECT_SIZE (EDEN_SIZE / 4)      // Larger objects are allocated tenured
+#define NURSERY_SIZE (EDEN_SIZE + 2 * SURVIVOR_SIZE)
+
+// Tenured semispaces
 extern size_t heap_size;
 extern intptr_t heap_start;
 extern intptr_t heap_ptr;
@@ -15,12 +38,29 @@ extern intptr_t to_space;
 extern intptr_t to_ptr;
 extern size_t total_bytes;
 
+// Eden and both survivor spaces, one contiguous mapping
+extern intptr_t nursery_start;
+#define IN_NURSERY(p) ((uintptr_t)((intptr_t)(p) - nursery_start) < NURSERY_SIZE)
+
 void init_heap();
 void *halloc(int);
 int garbage_collector();
 void print_detailed_memory();
 void print_heap_objects();
 
+/* Record a tenured object in the remembered set */
+void remember_object(void *);
+/* Out of line write_barrier for the jits' native stores */
+void write_barrier_call(void *, intptr_t);
+
+// Call after storing value into a slot of obj (untagged)
+static inline void write_barrier(void *obj, intptr_t value) {
+    if (IS_PTR(value) && IN_NURSERY(value) && !IN_NURSERY(obj) &&
+        !(*(intptr_t *)obj & REMEMBERED_BIT)) {
+        remember_object(obj);
+    }
+}
+
 // Forwarding pointers related operations
 int is_forward(intptr_t);
 void set_forward_address(intptr_t, intptr_t);
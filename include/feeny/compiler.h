@@ -24,6 +24,7 @@ typedef struct {
 typedef struct ScopeContext ScopeContext;
 struct ScopeContext {
     Vector *instructions;
+    Vector *lines; // Source line of each instruction: int
     Vector *locals;
     Vector *args;
     int nlocals;
@@ -48,6 +49,9 @@ typedef struct {
     Vector *pool;
     ScopeContext *scopeContext;
     ObjContext *objContext;
+    int depth;    // Operand stack depth after the last emitted instruction
+    int maxDepth; // Largest depth reached in the current method
+    int line;     // Source line of the statement being compiled
 } CompileInfo;
 static int addConstantValue(Vector *, Value *);
 
@@ -60,8 +64,10 @@ SlotValue *newSlotValue(int);
 ClassValue *newClassValue(Vector *);
 
 /* Compile from Ast to Program */
-static void compileScope(CompileInfo *, ScopeStmt *);
+static void emit(CompileInfo *, ByteIns *);
+static void compileScope(CompileInfo *, ScopeStmt *, int);
 static void compileExpr(CompileInfo *, Exp *);
+static void compileEffect(CompileInfo *, Exp *);
 
 Program *compile(ScopeStmt *stmt);
 
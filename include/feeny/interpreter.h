@@ -2,6 +2,7 @@
 #define INTERPRETER_H
 
 #include "feeny/ast.h"
+#include "feeny/output.h"
 #include "feeny/utils.h"
 #include <assert.h>
 #include <stdio.h>
@@ -0,0 +1,29 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "bytecode.h"
+#include "linker.h"
+#include "vm.h"
+#include <stddef.h>
+
+/**
+ * Baseline template JIT (x86-64 Linux)
+ * Each method's linked code is translated instruction by instruction into
+ * native code the first time the method runs. Simple instructions are
+ * inlined as fixed machine-code templates, the others call the vm's handlers.
+ * Frames, locals and operands stay where the interpreter keeps them, so the
+ * collector sees the same roots in both modes.
+ */
+typedef struct {
+    void *code;     // Executable buffer
+    size_t size;    // Size of the mapping
+    void **entries; // Native address of every linked instruction
+} JitCode;
+
+// Displacement of a Machine field for the generated code
+#define MACHINE_OFFSET(field) ((int32_t)offsetof(Machine, field))
+
+/* Run the machine from its current frame until the entry method returns */
+void jit_run(Machine *);
+
+#endif // JIT_H
@@ -0,0 +1,34 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include "bytecode.h"
+#include "runtimeObj.h"
+#include "utils.h"
+#include "vm.h"
+#include <stdint.h>
+
+/**
+ * Linked instruction executed by the vm
+ * Every method's code is flattened into one contiguous array of these
+ * fixed-width records, with constant pool operands already resolved.
+ */
+struct Instr {
+    void *handler; // Threaded-code address of the handler (NULL for switch dispatch)
+    OpCode op;     // Opcode of the instruction
+    int arity;     // Argument count of printf/call/call-slot
+    intptr_t arg;  // Local or global slot index, branch target, selector of calls
+    void *ref;     // Resolved pool operand: literal value, name string, print format or class template
+    void *cache;   // Per-site inline cache of call-slot and slot instructions, loop anchor of backward branches
+};
+
+/* Flatten a method's bytecode vector into its linked instruction array */
+void link_method(Machine *, MethodValue *);
+/* Generic opcode of a superinstruction's first instruction or of a quickened
+ * instruction, which keep its operands */
+OpCode base_opcode(OpCode);
+/* Link every method of the program, run once before execution */
+void link_program(Machine *);
+/* Store each opcode's threaded-code handler address into the linked code */
+void link_handlers(Machine *, void **);
+
+#endif // LINKER_H
@@ -0,0 +1,29 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+/**
+ * Buffered program output of printf
+ * The runtime owns stdout's buffer, so program output and any other text
+ * written to stdout (error messages) stay in order. Formats are split once
+ * into literal chunks around their ~ holes, and each printf writes the chunks
+ * and its formatted integers under a single stream lock.
+ */
+#define DEFAULT_OUTPUT_BUFFER 65536 // Bytes buffered before stdout is written
+
+typedef struct PrintFormat PrintFormat;
+struct PrintFormat {
+    int nholes;    // Number of ~ holes, one integer argument each
+    char **chunks; // nholes + 1 literal chunks around the holes
+    int *lengths;  // Length of each chunk
+};
+
+/* Split a printf format into its literal chunks */
+PrintFormat *compile_format(const char *);
+/* Buffer stdout with the given size, 0 flushes after every printf */
+void init_output(size_t);
+/* Write a compiled format with one integer per hole */
+void output_format(PrintFormat *, const long *);
+
+#endif // OUTPUT_H
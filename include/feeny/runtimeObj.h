@@ -8,9 +8,12 @@
 
 // RTObj -> Runtime Object
 struct RTObj {
-    ObjType type;
+    intptr_t header; // Type and layout, see MAKE_HEADER
 };
 
+// Type of a heap object
+#define OBJ_TYPE(obj) HEADER_TYPE(((RTObj *)(obj))->header)
+
 // // RInt -> Runtime Int Object
 // struct RInt {
 //     ObjType type;
@@ -25,14 +28,14 @@ struct RTObj {
 
 // RArray -> Runtime Array Object
 struct RArray {
-    ObjType type;
+    intptr_t header;
     size_t length;
     intptr_t slots[];
 };
 
 // RClass -> Runtime Class Instance Object
 struct RClass {
-    ObjType type;
+    intptr_t header;
     intptr_t parent;
     intptr_t var_slots[];
 };
@@ -43,6 +46,7 @@ struct TClass {
     int poolIndex;
     Vector *varNames;
     Map *funcNameToPoolIndex;
+    void **methods; // MethodValue of each selector, NULL where the class defines none
 };
 
 RInt newIntObj(int);
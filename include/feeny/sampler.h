@@ -0,0 +1,30 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "bytecode.h"
+#include "linker.h"
+#include "vm.h"
+#include <signal.h>
+
+/**
+ * Sampling profiler of the bytecode interpreter
+ * An ITIMER_PROF signal only sets sample_pending. Branches, calls and returns
+ * are linked to the interpreter's sample stub, a safe point that records the
+ * call stack with the current method and ip once a sample is pending. Every
+ * loop and call passes one, so ticks are taken promptly. Stacks are written
+ * in folded format ("caller:line;callee:line count"), ready for flamegraph
+ * tools.
+ */
+#define MAX_SAMPLE_DEPTH 128 // Frames kept from the top of a sampled stack
+
+/* Set by the timer, cleared by take_sample */
+extern volatile sig_atomic_t sample_pending;
+
+/* Start the timer */
+void start_sampler();
+/* Record the stack of the current frame at ip */
+void take_sample(Machine *, int ip);
+/* Stop the timer and write the folded stacks to vm_options.sample_file */
+void stop_sampler(Machine *);
+
+#endif // SAMPLER_H
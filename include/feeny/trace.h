@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "bytecode.h"
+#include "linker.h"
+#include "vm.h"
+
+/**
+ * Trace jit for hot loops (x86-64 Linux)
+ * Taken backward branches count how often their loop runs. Once a loop is
+ * hot, the next iteration is executed by a recorder that logs the path it
+ * takes, which is then compiled to native code with guards on the int and
+ * array types and the branch directions seen while recording. From then on
+ * the loop's backward branch enters the native trace, and a failing guard
+ * writes the operand stack back and resumes the interpreter at the guarded
+ * instruction.
+ */
+#define HOT_LOOP_THRESHOLD 64
+#define MAX_TRACE_LENGTH 512
+#define MAX_TRACE_ABORTS 4
+
+typedef struct Trace Trace;
+
+// Per loop state, attached by the linker to the loop's backward BRANCH_OP
+typedef struct {
+    int count;    // Taken backward branches since the last recording attempt
+    int aborts;   // Failed recordings, the loop is left alone after MAX_TRACE_ABORTS
+    Trace *trace; // Compiled trace, NULL until the loop gets hot
+} LoopAnchor;
+
+/* Count, record or run the loop of a taken backward branch at machine->ip.
+ * Returns 1 when it moved the machine to another ip and stack top */
+int trace_loop_edge(Machine *, Instr *);
+/* Print the trace jit's counters to stderr */
+void print_trace_stats(Machine *);
+
+#endif // TRACE_H
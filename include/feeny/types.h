@@ -33,6 +33,27 @@
 #define BROKEN_HEART -1
 typedef intptr_t ObjType;
 
+/**
+ * Heap object header
+ * The first word of every heap object packs its type with its layout, so the
+ * collector sizes and scans any object without looking up its class:
+ *   bits 0-15   ObjType
+ *   bits 16-23  untagged words after the header (an array's length)
+ *   bits 24-27  age, the minor collections a young object survived
+ *   bit  28     tenured object recorded in the remembered set
+ *   bits 32-63  tagged slots after those, up to the end of the object
+ * A forwarded object's header is BROKEN_HEART as a whole.
+ */
+#define MAKE_HEADER(type, raw, slots) (((intptr_t)(slots) << 32) | ((intptr_t)(raw) << 16) | (intptr_t)(type))
+#define HEADER_TYPE(h) ((ObjType)(int16_t)((h) & 0xFFFF))
+#define HEADER_RAW(h) (((h) >> 16) & 0xFF)
+#define HEADER_AGE(h) (((h) >> 24) & 0xF)
+#define AGE_MASK ((intptr_t)0xF << 24)
+#define REMEMBERED_BIT ((intptr_t)1 << 28)
+#define HEADER_SLOTS(h) ((size_t)((uintptr_t)(h) >> 32))
+#define HEADER_WORDS(h) (1 + HEADER_RAW(h) + HEADER_SLOTS(h))
+#define MAX_OBJ_TYPE 0x7FFF
+
 // Forward declarations
 typedef struct RTObj RTObj;
 typedef intptr_t RInt;
@@ -12,41 +12,132 @@ struct Frame {
     MethodValue *method;
     intptr_t locals[];
 };
-static Frame *newFrame(MethodValue *);
+
+/**
+ * Contiguous call stack
+ * Frames are pushed and popped with a bump pointer. The region grows by
+ * doubling; growing moves it, so frame links are rebased after a resize.
+ */
+typedef struct {
+    char *base;  // Bottom frame
+    char *top;   // First free byte above the current frame
+    char *limit; // End of the allocated region
+    int depth;   // Number of live frames
+} FrameStack;
+
+/**
+ * Operand stack
+ * A flat array of tagged values. Each method's maximum depth is known from the
+ * compiler, so capacity is only checked when a frame is pushed and the
+ * push/pop operations themselves are unchecked.
+ */
+typedef struct {
+    intptr_t *base;  // Bottom of the stack
+    intptr_t *top;   // First free slot
+    intptr_t *limit; // End of the allocated region
+} OperandStack;
+
+/**
+ * Per call site inline cache of CALL_SLOT_OP
+ * Maps a receiver type to the method that type defines under the call's name,
+ * or NULL when the type does not define it and the lookup goes on to the parent.
+ * A site starts monomorphic (one entry) and grows into a polymorphic cache of up
+ * to IC_ENTRIES types; after that it is megamorphic and misses go to lookup_method.
+ */
+#define IC_ENTRIES 4
+typedef struct {
+    int size;
+    int megamorphic;
+    ObjType types[IC_ENTRIES];
+    MethodValue *methods[IC_ENTRIES];
+} InlineCache;
+
+/**
+ * Per site cache of SLOT_OP and SET_SLOT_OP
+ * Remembers the slot offset of the last receiver type, so field accesses only
+ * search the template's slot names when a new type shows up at the site.
+ */
+typedef struct {
+    ObjType type;
+    int index;
+} SlotCache;
+
+/**
+ * Per method counters of --profile
+ * Instructions are counted as dispatched, so a superinstruction counts once.
+ */
+typedef struct {
+    long calls;
+    long instructions;
+    long bytes; // Heap bytes allocated by the method's own instructions
+} MethodProfile;
+
+// Runtime options of the vm, set from the command line
+typedef struct {
+    int ic_stats;            // Print inline cache hit/miss counters at exit
+    int max_depth;           // Maximum number of nested calls before a stack overflow
+    int jit;                 // Run methods as native code compiled by the baseline jit
+    int trace_jit;           // Compile the interpreter's hot loops into native traces
+    int trace_stats;         // Print trace jit counters at exit
+    int profile;             // Count calls, instructions and allocated bytes per method
+    char *sample_file;       // Folded stacks of the sampling profiler, NULL when off
+    int sample_interval;     // Microseconds of cpu time between samples
+    size_t heap_initial;     // Bytes of the tenured heap before it first grows
+    size_t heap_max;         // Bytes the tenured heap may grow to, 0 fits the address space
+    int gc_target_occupancy;  // Percent of the tenured heap live after a major collection
+} VMOptions;
+
+#define DEFAULT_MAX_DEPTH 1000000
+#define DEFAULT_SAMPLE_INTERVAL 1000
+#define DEFAULT_HEAP_INITIAL ((size_t)1 << 20)
+#define DEFAULT_HEAP_MAX ((size_t)16 << 30) // Largest heap reserved when heap_max is 0
+#define DEFAULT_GC_TARGET_OCCUPANCY 70
+
+extern VMOptions vm_options;
 
 typedef struct {
     Program *program;
-    Vector *stack;
+    OperandStack stack;
     RClass *global;
-    Vector *classes; // All template Classes
-    Frame *cur;      // Current code frame
-    intptr_t ip;     // Instruction pointer
+    Vector *classes;    // All template Classes
+    TClass **templates; // Template class of each ObjType, NULL for the builtin types
+    int ntypes;         // Length of templates
+    Vector *selectors;  // Interned method names, a selector is an index into it
+    FrameStack frames;
+    Frame *cur;         // Current code frame
+    intptr_t ip;        // Instruction pointer
+    void **handlers;    // Threaded-code handler of each opcode
 } Machine;
 
 extern Machine *machine;
 
+/* Template class of an object type, NULL for the builtin types */
+static inline TClass *class_of_type(Machine *machine, ObjType type) {
+    return type >= 0 && type < machine->ntypes ? machine->templates[type] : NULL;
+}
+
 /* Link source program to vm */
 void initvm(Program *);
 /* Run vm to execute source program */
 void runvm();
-/* Handle all kinds of instructions */
-static MethodValue *lookup_method(Machine *, ObjType, char *);
-static void handle_lit_instr(Machine *, LitIns *);
-static void handle_label_instr(Machine *, LabelIns *);
-static void handle_print_instr(Machine *, PrintfIns *);
-static void handle_array_instr(Machine *);
-static void handle_object_instr(Machine *, ObjectIns *);
-static void handle_slot_instr(Machine *, SlotIns *);
-static void handle_set_slot_instr(Machine *, SetSlotIns *);
-static void handle_call_slot_instr(Machine *, CallSlotIns *);
-static void handle_call_instr(Machine *, CallIns *);
-static void handle_get_local_instr(Machine *, GetLocalIns *);
-static void handle_set_local_instr(Machine *, SetLocalIns *);
-static void handle_get_global_instr(Machine *, GetGlobalIns *);
-static void handle_set_global_instr(Machine *, SetGlobalIns *);
-static void handle_goto_instr(Machine *, GotoIns *);
-static void handle_branch_instr(Machine *, BranchIns *);
-static void handle_return_instr(Machine *);
-static void handle_drop_instr(Machine *);
+/* Selector of a method name, -1 when no class defines a method of that name */
+int selector_id(Machine *, char *);
+/* Handle all kinds of instructions, shared by the interpreter loop and the jit */
+static MethodValue *lookup_method(Machine *, ObjType, int);
+static MethodValue *cached_lookup_method(Machine *, InlineCache *, ObjType, int);
+static int cached_slot_index(Machine *, SlotCache *, ObjType, char *);
+void handle_lit_instr(Machine *, Instr *);
+void handle_print_instr(Machine *, Instr *);
+void handle_array_instr(Machine *);
+void handle_object_instr(Machine *, Instr *);
+void handle_slot_instr(Machine *, Instr *);
+void handle_set_slot_instr(Machine *, Instr *);
+void handle_call_slot_instr(Machine *, Instr *);
+void handle_call_instr(Machine *, Instr *);
+void handle_tail_call_slot_instr(Machine *, Instr *);
+void handle_tail_call_instr(Machine *, Instr *);
+void handle_call_direct_instr(Machine *, Instr *);
+void handle_tail_call_direct_instr(Machine *, Instr *);
+void handle_return_instr(Machine *);
 
 #endif
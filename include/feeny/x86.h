@@ -0,0 +1,198 @@
+#ifndef X86_H
+#define X86_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20
+#endif
+
+/**
+ * x86-64 code emission shared by the baseline and the trace jit
+ * Code is assembled into a growable buffer and copied into its own
+ * executable mapping once it is complete.
+ */
+enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15
+};
+
+// Condition codes of jcc/cmovcc
+enum {
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF
+};
+
+// Code buffer, copied into an executable mapping once the code is complete
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+} Asm;
+
+static inline void initAsm(Asm *a, size_t cap) {
+    a->cap = cap;
+    a->len = 0;
+    a->buf = (uint8_t *)malloc(cap);
+    if (!a->buf) {
+        fprintf(stderr, "Memory allocation failed for jit buffer\n");
+        exit(1);
+    }
+}
+
+static inline void emitByte(Asm *a, uint8_t b) {
+    if (a->len >= a->cap) {
+        a->cap = 2 * a->cap + 64;
+        a->buf = (uint8_t *)realloc(a->buf, a->cap);
+        if (!a->buf) {
+            fprintf(stderr, "Memory allocation failed for jit buffer\n");
+            exit(1);
+        }
+    }
+    a->buf[a->len++] = b;
+}
+
+static inline void emitInt32(Asm *a, int32_t v) {
+    for (int i = 0; i < 4; i++) {
+        emitByte(a, (uint8_t)(v >> (8 * i)));
+    }
+}
+
+static inline void emitInt64(Asm *a, int64_t v) {
+    for (int i = 0; i < 8; i++) {
+        emitByte(a, (uint8_t)(v >> (8 * i)));
+    }
+}
+
+// REX.W prefix with the high bits of the reg and rm fields
+static inline void emitRex(Asm *a, int reg, int rm) {
+    emitByte(a, 0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+}
+
+// opcode reg, [base + disp32]
+static inline void emitMem(Asm *a, uint8_t opcode, int reg, int base, int32_t disp) {
+    emitRex(a, reg, base);
+    emitByte(a, opcode);
+    emitByte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emitByte(a, 0x24); // SIB for rsp/r12 based addressing
+    }
+    emitInt32(a, disp);
+}
+
+// opcode rm, reg with both operands in registers
+static inline void emitRegReg(Asm *a, uint8_t opcode, int reg, int rm) {
+    emitRex(a, reg, rm);
+    emitByte(a, opcode);
+    emitByte(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static inline void emitLoad(Asm *a, int dst, int base, int32_t disp) {
+    emitMem(a, 0x8B, dst, base, disp);
+}
+
+static inline void emitStore(Asm *a, int base, int32_t disp, int src) {
+    emitMem(a, 0x89, src, base, disp);
+}
+
+static inline void emitMovImm(Asm *a, int dst, int64_t imm) {
+    emitByte(a, 0x48 | ((dst & 8) >> 3));
+    emitByte(a, 0xB8 + (dst & 7));
+    emitInt64(a, imm);
+}
+
+// add/sub reg, imm8 (ext 0 is add, 5 is sub)
+static inline void emitAluImm8(Asm *a, int ext, int reg, int8_t imm) {
+    emitRex(a, 0, reg);
+    emitByte(a, 0x83);
+    emitByte(a, 0xC0 | (ext << 3) | (reg & 7));
+    emitByte(a, (uint8_t)imm);
+}
+
+// add/sub/cmp reg, imm32 (ext 0 is add, 5 is sub, 7 is cmp)
+static inline void emitAluImm32(Asm *a, int ext, int reg, int32_t imm) {
+    emitRex(a, 0, reg);
+    emitByte(a, 0x81);
+    emitByte(a, 0xC0 | (ext << 3) | (reg & 7));
+    emitInt32(a, imm);
+}
+
+// Shift reg by imm8 (ext 4 is shl, 7 is sar)
+static inline void emitShift(Asm *a, int ext, int reg, uint8_t imm) {
+    emitRex(a, 0, reg);
+    emitByte(a, 0xC1);
+    emitByte(a, 0xC0 | (ext << 3) | (reg & 7));
+    emitByte(a, imm);
+}
+
+// Two byte opcode 0F xx dst, src (imul, cmovcc)
+static inline void emitOp0F(Asm *a, uint8_t opcode, int dst, int src) {
+    emitRex(a, dst, src);
+    emitByte(a, 0x0F);
+    emitByte(a, opcode);
+    emitByte(a, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// jmp/jcc rel32, returns the position of the displacement to patch
+static inline size_t emitJump(Asm *a, int cc) {
+    if (cc < 0) {
+        emitByte(a, 0xE9);
+    } else {
+        emitByte(a, 0x0F);
+        emitByte(a, 0x80 + cc);
+    }
+    size_t pos = a->len;
+    emitInt32(a, 0);
+    return pos;
+}
+
+static inline void patchJump(Asm *a, size_t pos, size_t target) {
+    int32_t rel = (int32_t)(target - (pos + 4));
+    memcpy(a->buf + pos, &rel, 4);
+}
+
+static inline void emitCall(Asm *a, void *fn) {
+    emitMovImm(a, RAX, (int64_t)(intptr_t)fn);
+    emitByte(a, 0xFF);
+    emitByte(a, 0xD0); // call rax
+}
+
+// Copy the assembled code into a mapping that is executable but no longer
+// writable, returns it and stores the mapping's size
+static inline void *finishAsm(Asm *a, size_t *size) {
+    *size = (a->len + 4095) & ~(size_t)4095;
+    void *code = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        fprintf(stderr, "Memory allocation failed for jit code\n");
+        exit(1);
+    }
+    memcpy(code, a->buf, a->len);
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "Error: cannot make jit code executable\n");
+        exit(1);
+    }
+    free(a->buf);
+    a->buf = NULL;
+    return code;
+}
+
+#endif // X86_H
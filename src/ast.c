@@ -23,6 +23,7 @@ Exp *make_PrintfExp(char *format, int nexps, Exp **exps) {
     e->format = format;
     e->nexps = nexps;
     e->exps = exps;
+    e->compiled = NULL;
     return (Exp *)e;
 }
 
@@ -132,6 +133,7 @@ SlotStmt *make_SlotMethod(char *name, int nargs, char **args, ScopeStmt *body) {
 ScopeStmt *make_ScopeVar(char *name, Exp *exp) {
     ScopeVar *s = malloc(sizeof(ScopeVar));
     s->tag = VAR_STMT;
+    s->line = 0;
     s->name = name;
     s->exp = exp;
     return (ScopeStmt *)s;
@@ -140,6 +142,7 @@ ScopeStmt *make_ScopeVar(char *name, Exp *exp) {
 ScopeStmt *make_ScopeFn(char *name, int nargs, char **args, ScopeStmt *body) {
     ScopeFn *s = malloc(sizeof(ScopeFn));
     s->tag = FN_STMT;
+    s->line = 0;
     s->name = name;
     s->nargs = nargs;
     s->args = args;
@@ -150,6 +153,7 @@ ScopeStmt *make_ScopeFn(char *name, int nargs, char **args, ScopeStmt *body) {
 ScopeStmt *make_ScopeSeq(ScopeStmt *a, ScopeStmt *b) {
     ScopeSeq *s = malloc(sizeof(ScopeSeq));
     s->tag = SEQ_STMT;
+    s->line = 0;
     s->a = a;
     s->b = b;
     return (ScopeStmt *)s;
@@ -158,6 +162,7 @@ ScopeStmt *make_ScopeSeq(ScopeStmt *a, ScopeStmt *b) {
 ScopeStmt *make_ScopeExp(Exp *exp) {
     ScopeExp *s = malloc(sizeof(ScopeExp));
     s->tag = EXP_STMT;
+    s->line = 0;
     s->exp = exp;
     return (ScopeStmt *)s;
 }
@@ -136,7 +136,7 @@ ByteIns *read_ins() {
     }
 #define RETURN_NEW_VAL4(TYPE, w, wv, x, xv, y, yv, z, zv) \
     {                                                     \
-        TYPE *o = malloc(sizeof(TYPE));                   \
+        TYPE *o = calloc(1, sizeof(TYPE));                \
         o->tag = tag;                                     \
         o->w = wv;                                        \
         o->x = xv;                                        \
@@ -315,6 +315,37 @@ void print_ins(ByteIns *ins) {
         printf("   call #%d %d", i->name, i->arity);
         break;
     }
+    case TAIL_CALL_SLOT_OP: {
+        CallSlotIns *i = (CallSlotIns *)ins;
+        printf("   tail-call-slot #%d %d", i->name, i->arity);
+        break;
+    }
+    case TAIL_CALL_OP: {
+        CallIns *i = (CallIns *)ins;
+        printf("   tail-call #%d %d", i->name, i->arity);
+        break;
+    }
+    case ADD_INT_OP:
+    case SUB_INT_OP:
+    case MUL_INT_OP:
+    case DIV_INT_OP:
+    case MOD_INT_OP:
+    case LT_INT_OP:
+    case GT_INT_OP:
+    case LE_INT_OP:
+    case GE_INT_OP:
+    case EQ_INT_OP: {
+        CallSlotIns *i = (CallSlotIns *)ins;
+        printf("   int-op #%d %d", i->name, i->arity);
+        break;
+    }
+    case ARRAY_GET_OP:
+    case ARRAY_SET_OP:
+    case ARRAY_LEN_OP: {
+        CallSlotIns *i = (CallSlotIns *)ins;
+        printf("   array-op #%d %d", i->name, i->arity);
+        break;
+    }
     case SET_LOCAL_OP: {
         SetLocalIns *i = (SetLocalIns *)ins;
         printf("   set local %d", i->idx);
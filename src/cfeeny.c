@@ -2,10 +2,13 @@
 #include "feeny/bytecode.h"
 #include "feeny/compiler.h"
 #include "feeny/interpreter.h"
+#include "feeny/output.h"
 #include "feeny/parser.h"
 #include "feeny/utils.h"
 #include "feeny/vm.h"
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,7 +19,26 @@ void print_usage(const char *program_name) {
     printf("Options:\n");
     printf("  -a, --ast             Run AST interpreter (default)\n");
     printf("  -f, --fullBytecode    Run bytecode compiler and interpreter\n");
+    printf("  -j, --jit             Run bytecode compiler and the baseline jit (x86-64 Linux)\n");
+    printf("  --ic-stats            Print inline cache statistics of the bytecode vm\n");
+    printf("  --max-depth <n>       Maximum call depth of the bytecode vm (default %d)\n", DEFAULT_MAX_DEPTH);
+    printf("  --trace-jit           Compile hot loops of the bytecode vm into native traces (x86-64 Linux)\n");
+    printf("  --trace-stats         Print trace jit statistics\n");
+    printf("  --profile             Print calls, instructions and allocated bytes per method\n");
+    printf("  --sample <file>       Write sampled call stacks by source line to file, in folded format\n");
+    printf("  --sample-interval <n> Microseconds of cpu time between samples (default %d)\n", DEFAULT_SAMPLE_INTERVAL);
+    printf("  --output-buffer <n>   Bytes of program output buffered before writing, k/m/g suffixes allowed\n");
+    printf("                        (default %d, 0 writes each printf)\n", DEFAULT_OUTPUT_BUFFER);
+    printf("  --heap-initial <n>    Bytes of the tenured heap before it first grows, k/m/g suffixes allowed (default 1m)\n");
+    printf("  --heap-max <n>        Bytes the tenured heap may grow to before running out of memory\n");
+    printf("                        (default up to 16g, as much as the address space limit allows)\n");
+    printf("  --gc-target-occupancy <n>\n");
+    printf("                        Percent of the heap live after a full collection, the heap grows above it\n");
+    printf("                        and shrinks under half of it (default %d)\n", DEFAULT_GC_TARGET_OCCUPANCY);
     printf("  -h, --help            Show this help message\n");
+    printf("Environment:\n");
+    printf("  FEENY_HEAP_INITIAL, FEENY_HEAP_MAX, FEENY_GC_TARGET_OCCUPANCY\n");
+    printf("                        Defaults of the heap options, the command line overrides them\n");
     exit(1);
 }
 
@@ -25,28 +47,154 @@ typedef enum {
     MODE_FULL
 } RunMode;
 
+// Long-only options
+enum {
+    OPT_IC_STATS = 256,
+    OPT_MAX_DEPTH,
+    OPT_TRACE_JIT,
+    OPT_TRACE_STATS,
+    OPT_PROFILE,
+    OPT_SAMPLE,
+    OPT_SAMPLE_INTERVAL,
+    OPT_OUTPUT_BUFFER,
+    OPT_HEAP_INITIAL,
+    OPT_HEAP_MAX,
+    OPT_GC_TARGET_OCCUPANCY
+};
+
+// Positive int with nothing after it, -1 when malformed or out of range
+static int parse_count(const char *text) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || value <= 0 || value > INT_MAX) {
+        return -1;
+    }
+    return (int)value;
+}
+
+// Byte count with an optional k, m or g suffix, -1 when malformed
+static long parse_size(const char *text) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || errno == ERANGE || value < 0) {
+        return -1;
+    }
+    int shift = 0;
+    switch (*end) {
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        break;
+    case '\0':
+        return value;
+    default:
+        return -1;
+    }
+    if (end[1] != '\0' || value > (LONG_MAX >> shift)) {
+        return -1;
+    }
+    return value << shift;
+}
+
+// Set a heap option from its command line or environment text
+static void set_heap_option(int option, const char *text, const char *name, const char *program_name) {
+    long value;
+    if (option == OPT_GC_TARGET_OCCUPANCY) {
+        char *end;
+        value = strtol(text, &end, 10);
+        if (end == text || *end != '\0') {
+            value = -1;
+        }
+    } else {
+        value = parse_size(text);
+    }
+    if (option == OPT_GC_TARGET_OCCUPANCY && (value < 1 || value > 99)) {
+        fprintf(stderr, "Error: %s expects a percentage between 1 and 99\n", name);
+        print_usage(program_name);
+    }
+    if (option != OPT_GC_TARGET_OCCUPANCY && value <= 0) {
+        fprintf(stderr, "Error: %s expects a positive size\n", name);
+        print_usage(program_name);
+    }
+    switch (option) {
+    case OPT_HEAP_INITIAL:
+        vm_options.heap_initial = (size_t)value;
+        break;
+    case OPT_HEAP_MAX:
+        vm_options.heap_max = (size_t)value;
+        break;
+    default:
+        vm_options.gc_target_occupancy = (int)value;
+        break;
+    }
+}
+
 int main(int argc, char **argv) {
     RunMode mode = MODE_AST;
+    int mode_given = 0; // -a or -f was given
     int verbose = 0;
+    long output_buffer = DEFAULT_OUTPUT_BUFFER;
 
     static struct option long_options[] = {
         {"ast", no_argument, 0, 'a'},
         {"full", no_argument, 0, 'f'},
+        {"jit", no_argument, 0, 'j'},
         {"verbose", no_argument, 0, 'v'},
         {"help", no_argument, 0, 'h'},
+        {"ic-stats", no_argument, 0, OPT_IC_STATS},
+        {"max-depth", required_argument, 0, OPT_MAX_DEPTH},
+        {"trace-jit", no_argument, 0, OPT_TRACE_JIT},
+        {"trace-stats", no_argument, 0, OPT_TRACE_STATS},
+        {"profile", no_argument, 0, OPT_PROFILE},
+        {"sample", required_argument, 0, OPT_SAMPLE},
+        {"sample-interval", required_argument, 0, OPT_SAMPLE_INTERVAL},
+        {"output-buffer", required_argument, 0, OPT_OUTPUT_BUFFER},
+        {"heap-initial", required_argument, 0, OPT_HEAP_INITIAL},
+        {"heap-max", required_argument, 0, OPT_HEAP_MAX},
+        {"gc-target-occupancy", required_argument, 0, OPT_GC_TARGET_OCCUPANCY},
         {0, 0, 0, 0}};
 
+    // Heap options from the environment, the command line overrides them
+    static const struct {
+        int option;
+        const char *name;
+    } heap_env[] = {
+        {OPT_HEAP_INITIAL, "FEENY_HEAP_INITIAL"},
+        {OPT_HEAP_MAX, "FEENY_HEAP_MAX"},
+        {OPT_GC_TARGET_OCCUPANCY, "FEENY_GC_TARGET_OCCUPANCY"}};
+    for (size_t i = 0; i < sizeof(heap_env) / sizeof(heap_env[0]); i++) {
+        const char *text = getenv(heap_env[i].name);
+        if (text && *text) {
+            set_heap_option(heap_env[i].option, text, heap_env[i].name, argv[0]);
+        }
+    }
+
     int option;
     int option_index = 0;
 
-    while ((option = getopt_long(argc, argv, "avhf",
+    while ((option = getopt_long(argc, argv, "avhfj",
                                  long_options, &option_index)) != -1) {
         switch (option) {
         case 'a':
             mode = MODE_AST;
+            mode_given = 1;
             break;
         case 'f':
             mode = MODE_FULL;
+            mode_given = 1;
+            break;
+        case 'j':
+            vm_options.jit = 1;
             break;
         case 'v':
             verbose = 1;
@@ -54,6 +202,51 @@ int main(int argc, char **argv) {
         case 'h':
             print_usage(argv[0]);
             break;
+        case OPT_IC_STATS:
+            vm_options.ic_stats = 1;
+            break;
+        case OPT_MAX_DEPTH:
+            vm_options.max_depth = parse_count(optarg);
+            if (vm_options.max_depth <= 0) {
+                fprintf(stderr, "Error: --max-depth expects a positive number\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case OPT_TRACE_JIT:
+            vm_options.trace_jit = 1;
+            break;
+        case OPT_TRACE_STATS:
+            vm_options.trace_stats = 1;
+            break;
+        case OPT_PROFILE:
+            vm_options.profile = 1;
+            break;
+        case OPT_SAMPLE:
+            vm_options.sample_file = optarg;
+            break;
+        case OPT_SAMPLE_INTERVAL:
+            vm_options.sample_interval = parse_count(optarg);
+            if (vm_options.sample_interval <= 0) {
+                fprintf(stderr, "Error: --sample-interval expects a positive number\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case OPT_OUTPUT_BUFFER:
+            output_buffer = parse_size(optarg);
+            if (output_buffer < 0) {
+                fprintf(stderr, "Error: --output-buffer expects a non-negative size\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case OPT_HEAP_INITIAL:
+            set_heap_option(option, optarg, "--heap-initial", argv[0]);
+            break;
+        case OPT_HEAP_MAX:
+            set_heap_option(option, optarg, "--heap-max", argv[0]);
+            break;
+        case OPT_GC_TARGET_OCCUPANCY:
+            set_heap_option(option, optarg, "--gc-target-occupancy", argv[0]);
+            break;
         case '?':
             // getopt_long already printed an error message
             print_usage(argv[0]);
@@ -63,12 +256,46 @@ int main(int argc, char **argv) {
         }
     }
 
+    // Options of the bytecode vm select it, unless -a asks for the ast interpreter
+    int vm_only = vm_options.jit || vm_options.trace_jit || vm_options.ic_stats ||
+                  vm_options.trace_stats || vm_options.profile || vm_options.sample_file;
+    if (vm_only && mode == MODE_AST) {
+        if (mode_given) {
+            fprintf(stderr, "Error: -j, --ic-stats, --trace-jit, --trace-stats, --profile and --sample cannot be combined with -a\n");
+            print_usage(argv[0]);
+        }
+        mode = MODE_FULL;
+    }
+    // Traces are recorded by the interpreter loop, which the baseline jit replaces
+    if (vm_options.jit && vm_options.trace_jit) {
+        fprintf(stderr, "Error: -j cannot be combined with --trace-jit\n");
+        print_usage(argv[0]);
+    }
+    // The profiler counts what the interpreter dispatches, native code bypasses it
+    if (vm_options.profile && (vm_options.jit || vm_options.trace_jit)) {
+        fprintf(stderr, "Error: --profile cannot be combined with -j or --trace-jit\n");
+        print_usage(argv[0]);
+    }
+    // Samples are taken by the interpreter's dispatch, which the other modes replace
+    if (vm_options.sample_file && (vm_options.jit || vm_options.trace_jit || vm_options.profile)) {
+        fprintf(stderr, "Error: --sample cannot be combined with -j, --trace-jit or --profile\n");
+        print_usage(argv[0]);
+    }
+
+    if (vm_options.heap_max && vm_options.heap_initial > vm_options.heap_max) {
+        fprintf(stderr, "Error: --heap-initial cannot be larger than --heap-max\n");
+        print_usage(argv[0]);
+    }
+
     // Check if a filename was provided
     if (optind >= argc) {
         fprintf(stderr, "Error: No input file specified\n");
         print_usage(argv[0]);
     }
 
+    // stdout can only be rebuffered before anything is written to it
+    init_output((size_t)output_buffer);
+
     char *filename = argv[optind];
     if (verbose) {
         printf("Mode: %s\n", mode == MODE_AST ? "AST" : "Bytecode");
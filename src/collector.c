@@ -8,8 +8,8 @@
 
 // #define MEMORY_DEBUG 1
 
-// heap_size = 1MB
-size_t heap_size = 1024 * 1024;
+// Usable bytes of the tenured heap, vm_options.heap_initial at first
+size_t heap_size = 0;
 
 // Core variables for garbage collector
 intptr_t heap_start = 0;
@@ -18,14 +18,32 @@ intptr_t to_space = 0;
 intptr_t to_ptr = 0;
 size_t total_bytes = 0;
 
+// Committed bytes of each semispace, the to-space may have more than
+// heap_size during a major collection
+static size_t from_committed = 0;
+static size_t to_committed = 0;
+
+// Nursery: eden, then the survivor spaces
+intptr_t nursery_start = 0;
+static intptr_t eden_ptr = 0;
+static intptr_t eden_end = 0;
+static intptr_t survivor_from = 0; // Survivors of the last minor collection
+static intptr_t survivor_ptr = 0;
+static intptr_t survivor_to = 0;
+
+// Remembered set, tenured objects that may refer to young ones
+static RTObj **remembered = NULL;
+static size_t nremembered = 0;
+static size_t remembered_cap = 0;
+
 // Helper function: check if an address is forward pointer
 int is_forward(intptr_t address) {
-    return ((RTObj *)address)->type == BROKEN_HEART;
+    return ((RTObj *)address)->header == BROKEN_HEART;
 }
 
 // Helper function: set forward address for an object
 void set_forward_address(intptr_t obj, intptr_t newAddress) {
-    ((RTObj *)obj)->type = BROKEN_HEART;
+    ((RTObj *)obj)->header = BROKEN_HEART;
     *((intptr_t *)obj + 1) = (intptr_t)newAddress;
 }
 
@@ -38,122 +56,237 @@ intptr_t get_forward_address(intptr_t obj) {
     return *((intptr_t *)obj + 1);
 }
 
-// Check if pointer is within heap
+// Check if pointer is within the tenured from-space
 static int is_heap_ptr(intptr_t ptr) {
     return ptr >= heap_start && ptr < heap_start + heap_size;
 }
 
-TClass *find_class_by_type(ObjType type) {
-    for (int i = 0; i < vector_size(machine->classes); i++) {
-        TClass *template = (TClass *)vector_get(machine->classes, i);
-        if (template->type == type) {
-            return template;
+// Helper function: get the size of an object from its header
+static size_t get_object_size(intptr_t obj) {
+    intptr_t header = ((RTObj *)obj)->header;
+    if (header == BROKEN_HEART) {
+        fprintf(stderr, "Error: Broken heart object can not be calculated\n");
+        exit(1);
+    }
+    return HEADER_WORDS(header) * sizeof(intptr_t);
+}
+
+#define PAGE_SIZE 4096
+#define PAGE_ALIGN(n) (((n) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1))
+
+static void *map_space(size_t size, int prot) {
+    void *space = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return space == MAP_FAILED ? NULL : space;
+}
+
+static void out_of_memory() {
+    fprintf(stderr, "Error: out of memory, the heap is limited to %zu bytes (--heap-max)\n",
+            vm_options.heap_max);
+    exit(1);
+}
+
+// Commit or decommit the tail of a reserved space so that its first size
+// bytes are usable, pages past them go back to the OS
+static void commit_space(intptr_t space, size_t *committed, size_t size) {
+    size = PAGE_ALIGN(size);
+    if (size > *committed) {
+        if (mprotect((void *)(space + *committed), size - *committed, PROT_READ | PROT_WRITE) != 0) {
+            out_of_memory();
         }
+    } else if (size < *committed) {
+        madvise((void *)(space + size), *committed - size, MADV_DONTNEED);
+        mprotect((void *)(space + size), *committed - size, PROT_NONE);
     }
-    return NULL;
+    *committed = size;
 }
 
-// Helper function: get the size of an object
-static size_t get_object_size(intptr_t obj) {
-    switch (((RTObj *)obj)->type) {
-    case INT_TYPE:
-        return 0;
-    case NULL_TYPE:
-        return 0;
-    case ARRAY_TYPE:
-        return sizeof(RArray) + ((RArray *)obj)->length * sizeof(intptr_t);
-    case BROKEN_HEART:
-        fprintf(stderr, "Error: Broken heart object can not be calculated\n");
-        exit(1);
-    default: {
-        // General case, lookup method's class template and calculate size
-        TClass *template = find_class_by_type(((RTObj *)obj)->type);
-        if (!template) {
-            fprintf(stderr, "Found type: %ld\n", ((RTObj *)obj)->type);
-            fprintf(stderr, "Error: Class template not found\n");
+void remember_object(void *obj) {
+    if (nremembered == remembered_cap) {
+        remembered_cap = 2 * remembered_cap + 256;
+        remembered = (RTObj **)realloc(remembered, sizeof(RTObj *) * remembered_cap);
+        if (!remembered) {
+            fprintf(stderr, "Memory allocation failed for remembered set\n");
             exit(1);
         }
-        return sizeof(RClass) + vector_size(template->varNames) * sizeof(intptr_t);
-    }
     }
+    ((RTObj *)obj)->header |= REMEMBERED_BIT;
+    remembered[nremembered++] = (RTObj *)obj;
 }
 
-// Copy object to to-space
-static intptr_t copy_object(intptr_t obj) {
-    if (!obj || !is_heap_ptr(obj))
-        return obj;
+void write_barrier_call(void *obj, intptr_t value) {
+    write_barrier(obj, value);
+}
 
-    if (IS_INT(obj) || IS_NULL(obj)) {
-        return obj;
-    }
+// The tagged slots that end every object
+static intptr_t *object_slots(intptr_t obj, size_t *n) {
+    intptr_t header = ((RTObj *)obj)->header;
+    *n = HEADER_SLOTS(header);
+    return (intptr_t *)obj + 1 + HEADER_RAW(header);
+}
 
-    obj = UNTAG_PTR(obj);
+//============================================================
+//===================== MINOR COLLECTION =====================
+//============================================================
 
-    // Check if already forwarded
+// Copy a young object into the survivor space, or tenured once it is old
+// enough or the survivor space is full
+static intptr_t copy_young(intptr_t value) {
+    if (!IS_PTR(value) || !IN_NURSERY(value)) {
+        return value;
+    }
+    intptr_t obj = UNTAG_PTR(value);
+    if (obj >= survivor_to && obj < survivor_to + SURVIVOR_SIZE) {
+        return value; // Copied in this collection
+    }
     if (is_forward(obj)) {
-        return get_forward_address(obj);
+        return TAG_PTR(get_forward_address(obj));
     }
 
-    // Copy object to to-space
     size_t size = get_object_size(obj);
-    intptr_t new_location = to_ptr;
+    intptr_t header = ((RTObj *)obj)->header;
+    intptr_t age = HEADER_AGE(header) + 1;
+    intptr_t new_location;
+    if (age < TENURE_AGE && survivor_ptr + (intptr_t)size <= survivor_to + SURVIVOR_SIZE) {
+        new_location = survivor_ptr;
+        survivor_ptr += size;
+    } else {
+        // minor_collection made sure the tenured space has room
+        new_location = heap_ptr;
+        heap_ptr += size;
+        age = 0;
+    }
+    memcpy((void *)new_location, (void *)obj, size);
+    ((RTObj *)new_location)->header = (header & ~AGE_MASK) | (age << 24);
+    set_forward_address(obj, new_location);
+    return TAG_PTR(new_location);
+}
 
-    memcpy((void *)to_ptr, (void *)obj, size);
-    to_ptr += size;
+// Copy the young objects a tenured object refers to, returns whether it
+// still refers to one
+static int scan_young_refs(intptr_t obj) {
+    size_t n;
+    intptr_t *slots = object_slots(obj, &n);
+    int young = 0;
+    for (size_t i = 0; i < n; i++) {
+        slots[i] = copy_young(slots[i]);
+        young |= IS_PTR(slots[i]) && IN_NURSERY(slots[i]);
+    }
+    return young;
+}
 
-    // Set forwarding address
-    set_forward_address(obj, new_location);
+static void scan_young_roots() {
+    TClass *globalTemplate = class_of_type(machine, GLOBAL_TYPE);
+    if (machine->global) {
+        machine->global = (RClass *)UNTAG_PTR(copy_young(TAG_PTR((intptr_t)machine->global)));
+        // Global slots are always roots, so global stores need no barrier
+        for (int i = 0; i < vector_size(globalTemplate->varNames); i++) {
+            machine->global->var_slots[i] = copy_young(machine->global->var_slots[i]);
+        }
+    }
 
-    return TAG_PTR(new_location);
+    char *p = machine->frames.base;
+    while (p < machine->frames.top) {
+        Frame *frame = (Frame *)p;
+        int slots_num = frame->method->nargs + frame->method->nlocals;
+        for (int i = 0; i < slots_num; i++) {
+            frame->locals[i] = copy_young(frame->locals[i]);
+        }
+        p += sizeof(Frame) + sizeof(intptr_t) * slots_num;
+    }
+
+    for (intptr_t *slot = machine->stack.base; slot < machine->stack.top; slot++) {
+        *slot = copy_young(*slot);
+    }
+
+    // Remembered objects stay in the set while they refer to a survivor
+    size_t n = nremembered;
+    nremembered = 0;
+    for (size_t i = 0; i < n; i++) {
+        RTObj *obj = remembered[i];
+        obj->header &= ~REMEMBERED_BIT;
+        if (scan_young_refs((intptr_t)obj)) {
+            remember_object(obj);
+        }
+    }
 }
 
-// Scan an object's pointers
-static void scan_object(intptr_t obj) {
-    if (!obj)
+static void major_collection(size_t request);
+
+static void minor_collection() {
+    size_t young = (eden_ptr - nursery_start) + (survivor_ptr - survivor_from);
+    if (heap_ptr + (intptr_t)young > heap_start + (intptr_t)heap_size) {
+        // Promotion could overflow the tenured space, collect everything
+        major_collection(0);
         return;
+    }
 
-    RTObj *robj = (RTObj *)obj;
-    switch (robj->type) {
-    case INT_TYPE:
-    case NULL_TYPE:
-        return; // No pointers
+    intptr_t scan_survivor = survivor_to;
+    intptr_t scan_tenured = heap_ptr;
+    survivor_ptr = survivor_to;
+    scan_young_roots();
 
-    case ARRAY_TYPE: {
-        RArray *arr = (RArray *)obj;
-        for (size_t i = 0; i < arr->length; i++) {
-            arr->slots[i] = copy_object(arr->slots[i]);
+    // Cheney scan of both destinations until neither has unscanned objects
+    while (scan_survivor < survivor_ptr || scan_tenured < heap_ptr) {
+        while (scan_survivor < survivor_ptr) {
+            scan_young_refs(scan_survivor);
+            scan_survivor += get_object_size(scan_survivor);
+        }
+        while (scan_tenured < heap_ptr) {
+            if (scan_young_refs(scan_tenured)) {
+                remember_object((void *)scan_tenured);
+            }
+            scan_tenured += get_object_size(scan_tenured);
         }
-        break;
     }
 
-    default: {
-        // Must be a class instance
-        RClass *cls = (RClass *)obj;
-        // Update parent pointer
-        cls->parent = copy_object(cls->parent);
+    intptr_t temp = survivor_from;
+    survivor_from = survivor_to;
+    survivor_to = temp;
+    eden_ptr = nursery_start;
+}
 
-        // Find class template
-        TClass *template = find_class_by_type(cls->type);
+//============================================================
+//===================== MAJOR COLLECTION =====================
+//============================================================
 
-        if (!template) {
-            print_detailed_memory();
-            fprintf(stderr, "Found type: %ld\n", cls->type);
-            fprintf(stderr, "Error: Class template not found\n");
-            exit(1);
-        }
+// Copy any object, young or tenured, to the tenured to-space
+static intptr_t copy_object(intptr_t value) {
+    if (!IS_PTR(value)) {
+        return value;
+    }
+    intptr_t obj = UNTAG_PTR(value);
+    if (!IN_NURSERY(obj) && !is_heap_ptr(obj)) {
+        return value;
+    }
+    if (is_forward(obj)) {
+        return TAG_PTR(get_forward_address(obj));
+    }
 
-        // Update all var slots
-        for (int i = 0; i < vector_size(template->varNames); i++) {
-            cls->var_slots[i] = copy_object(cls->var_slots[i]);
-        }
+    size_t size = get_object_size(obj);
+    if (to_ptr + (intptr_t)size > to_space + (intptr_t)to_committed) {
+        out_of_memory(); // The heap is at heap_max
     }
+    intptr_t new_location = to_ptr;
+    memcpy((void *)to_ptr, (void *)obj, size);
+    ((RTObj *)new_location)->header &= ~(AGE_MASK | REMEMBERED_BIT);
+    to_ptr += size;
+
+    set_forward_address(obj, new_location);
+    return TAG_PTR(new_location);
+}
+
+static void scan_object(intptr_t obj) {
+    size_t n;
+    intptr_t *slots = object_slots(obj, &n);
+    for (size_t i = 0; i < n; i++) {
+        slots[i] = copy_object(slots[i]);
     }
 }
 
 // Scan root set (globals, frames, operand stack)
 static void scan_root_set() {
     // Scan globals
-    TClass *globalTemplate = find_class_by_type(GLOBAL_TYPE);
+    TClass *globalTemplate = class_of_type(machine, GLOBAL_TYPE);
     if (machine->global) {
         for (int i = 0; i < vector_size(globalTemplate->varNames); i++) {
             machine->global->var_slots[i] = copy_object(machine->global->var_slots[i]);
@@ -161,116 +294,97 @@ static void scan_root_set() {
         machine->global = (RClass *)UNTAG_PTR((intptr_t)copy_object(TAG_PTR((intptr_t)machine->global)));
     }
 
-    // Scan frames
-    Frame *frame = machine->cur;
-    while (frame) {
+    // Scan frames, bottom-up through the contiguous call stack
+    char *p = machine->frames.base;
+    while (p < machine->frames.top) {
+        Frame *frame = (Frame *)p;
+        int slots_num = frame->method->nargs + frame->method->nlocals;
         // Scan local variables
-        for (int i = 0; i < frame->method->nargs + frame->method->nlocals; i++) {
+        for (int i = 0; i < slots_num; i++) {
             frame->locals[i] = copy_object(frame->locals[i]);
         }
-        frame = frame->parent;
+        p += sizeof(Frame) + sizeof(intptr_t) * slots_num;
     }
 
     // Scan operand stack
-    for (int i = 0; i < vector_size(machine->stack); i++) {
-        intptr_t obj = (intptr_t)vector_get(machine->stack, i);
-        vector_set(machine->stack, i, (void *)copy_object(obj));
+    for (intptr_t *slot = machine->stack.base; slot < machine->stack.top; slot++) {
+        *slot = copy_object(*slot);
     }
 }
 
-void init_heap() {
-    // Allocate 1GB heap space for from-space and to-space
-    heap_start = (intptr_t)mmap(NULL, heap_size,
-                                PROT_READ | PROT_WRITE,
-                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (heap_start == -1) {
-        fprintf(stderr, "Error: mmap failed\n");
-        exit(1);
+// Reserve both tenured semispaces, at most a quarter of the address space
+// limit each and halving the size while the mappings fail. Returns the size
+// reserved, 0 when not even heap_initial fits.
+static size_t reserve_heap(size_t size) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_AS, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        size > limit.rlim_cur / 4) {
+        size = (limit.rlim_cur / 4) & ~(size_t)(PAGE_SIZE - 1);
     }
-    heap_ptr = heap_start;
-
-    to_space = (intptr_t)mmap(NULL, heap_size,
-                              PROT_READ | PROT_WRITE,
-                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (to_space == -1) {
-        fprintf(stderr, "Error: mmap failed\n");
-        exit(1);
+    while (size >= vm_options.heap_initial) {
+        heap_start = (intptr_t)map_space(size, PROT_NONE);
+        to_space = (intptr_t)map_space(size, PROT_NONE);
+        if (heap_start && to_space) {
+            return size;
+        }
+        if (heap_start) {
+            munmap((void *)heap_start, size);
+        }
+        if (to_space) {
+            munmap((void *)to_space, size);
+        }
+        size = (size / 2) & ~(size_t)(PAGE_SIZE - 1);
     }
-    to_ptr = to_space;
-    total_bytes = 0;
+    return 0;
 }
-int expand_heap() {
-#ifdef MEMORY_DEBUG
-    printf("\n=== Expanding Heap ===\n");
-    printf("Current heap_size: %zu, new_size: %zu\n", heap_size, heap_size << 1);
-    printf("Before expansion:\n");
-    printf("  heap_start: %p\n", (void *)heap_start);
-    printf("  heap_ptr: %p (used: %zu bytes)\n", (void *)heap_ptr, heap_ptr - heap_start);
-    printf("  to_space: %p\n", (void *)to_space);
-#endif
-    size_t new_size = heap_size << 1;
 
-    intptr_t new_heap = (intptr_t)mmap(NULL, new_size,
-                                       PROT_READ | PROT_WRITE,
-                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (new_heap == -1) {
-        printf("Failed to allocate new heap space!\n");
-        return 0;
+void init_heap() {
+    // Both semispaces reserve heap_max bytes of address space, only the first
+    // heap_size bytes are committed
+    // Without --heap-max the heap is as large as the address space limit allows
+    int limited = vm_options.heap_max != 0;
+    size_t requested = limited ? PAGE_ALIGN(vm_options.heap_max) : DEFAULT_HEAP_MAX;
+    vm_options.heap_initial = PAGE_ALIGN(vm_options.heap_initial);
+    heap_size = vm_options.heap_initial;
+    nursery_start = (intptr_t)map_space(NURSERY_SIZE, PROT_READ | PROT_WRITE);
+    vm_options.heap_max = nursery_start ? reserve_heap(requested) : 0;
+    if (!vm_options.heap_max) {
+        fprintf(stderr, "Error: mmap failed, cannot reserve a heap of %zu bytes\n", heap_size);
+        exit(1);
     }
-
-    intptr_t old_to_space = to_space;
-    to_space = new_heap;
-#ifdef MEMORY_DEBUG
-    printf("Allocated new heap space at: %p\n", (void *)new_heap);
-    printf("Set new to_space: %p (old was: %p)\n", (void *)to_space, (void *)old_to_space);
-
-    printf("\nStarting garbage collection...\n");
-#endif
-    garbage_collector();
-
-#ifdef MEMORY_DEBUG
-    printf("Garbage collection completed\n");
-    printf("After GC:\n");
-    printf("  heap_start: %p\n", (void *)heap_start);
-    printf("  heap_ptr: %p (used: %zu bytes)\n", (void *)heap_ptr, heap_ptr - heap_start);
-    printf("  to_space: %p\n", (void *)to_space);
-
-    printf("\nReleasing old spaces...\n");
-    printf("  Releasing to_space: %p (size: %zu)\n", (void *)to_space, heap_size);
-    printf("  Releasing old_to_space: %p (size: %zu)\n", (void *)old_to_space, heap_size);
-#endif
-    munmap((void *)to_space, heap_size);
-    munmap((void *)old_to_space, heap_size);
-
-    intptr_t new_to_space = (intptr_t)mmap(NULL, new_size,
-                                           PROT_READ | PROT_WRITE,
-                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (new_to_space == -1) {
-        printf("Failed to allocate new to_space!\n");
-        munmap((void *)new_heap, new_size);
-        return 0;
+    if (limited && vm_options.heap_max < requested) {
+        fprintf(stderr, "Warning: heap limited to %zu bytes by the available address space\n",
+                vm_options.heap_max);
     }
+    commit_space(heap_start, &from_committed, heap_size);
+    commit_space(to_space, &to_committed, heap_size);
+    heap_ptr = heap_start;
+    to_ptr = to_space;
 
-    to_space = new_to_space;
-    heap_size = new_size;
+    eden_ptr = nursery_start;
+    eden_end = nursery_start + EDEN_SIZE;
+    survivor_from = eden_end;
+    survivor_ptr = survivor_from;
+    survivor_to = eden_end + SURVIVOR_SIZE;
+    total_bytes = 0;
+}
 
+// Resize both semispaces, objects stay where they are
+static void resize_heap(size_t new_size) {
 #ifdef MEMORY_DEBUG
-    printf("Allocated new to_space at: %p\n", (void *)new_to_space);
-    printf("\nFinal heap state:\n");
-    printf("  heap_start: %p\n", (void *)heap_start);
-    printf("  heap_ptr: %p (used: %zu bytes)\n", (void *)heap_ptr, heap_ptr - heap_start);
-    printf("  to_space: %p\n", (void *)to_space);
-    printf("Heap expanded from %zu to %zu bytes\n", heap_size / 2, heap_size);
-    printf("=== Heap Expansion Complete ===\n\n");
+    printf("Resizing heap from %zu to %zu bytes, used %zu bytes\n",
+           heap_size, new_size, heap_ptr - heap_start);
 #endif
-    return 1;
+    commit_space(heap_start, &from_committed, new_size);
+    commit_space(to_space, &to_committed, new_size);
+    heap_size = from_committed;
 }
 
+// Full collection of the nursery and the tenured space into the tenured
+// to-space, which must be able to take everything
 int garbage_collector() {
     to_ptr = to_space;
 
-    memset((void *)to_space, 0, heap_ptr - heap_start);
-
     scan_root_set();
 
     intptr_t scan = to_space;
@@ -280,47 +394,86 @@ int garbage_collector() {
     }
 
     intptr_t temp = heap_start;
+    size_t used = heap_ptr - heap_start;
     heap_start = to_space;
     to_space = temp;
     heap_ptr = to_ptr;
+    size_t committed = from_committed;
+    from_committed = to_committed;
+    to_committed = committed;
+    // The old from-space is garbage until the next major collection
+    madvise((void *)to_space, (used + 4095) & ~(size_t)4095, MADV_DONTNEED);
+
+    // Everything live is tenured now
+    nremembered = 0;
+    eden_ptr = nursery_start;
+    survivor_ptr = survivor_from;
     return 1;
 }
+
+// Whether need bytes exceed the target occupancy of a heap of size bytes
+static int over_target(size_t need, size_t size) {
+    return (double)need * 100 > (double)size * vm_options.gc_target_occupancy;
+}
+
+// Smallest doubling of the heap that holds need bytes at the target
+// occupancy, up to heap_max
+static size_t grown_size(size_t need) {
+    size_t new_size = heap_size;
+    while (new_size < vm_options.heap_max && over_target(need, new_size)) {
+        new_size <<= 1;
+    }
+    return new_size < vm_options.heap_max ? new_size : vm_options.heap_max;
+}
+
+// Major collection that leaves room for request tenured bytes and a
+// nursery's worth of promotions
+static void major_collection(size_t request) {
+    // The to-space must be able to take everything that may be live, the
+    // resize after the collection settles both spaces
+    size_t young = (eden_ptr - nursery_start) + (survivor_ptr - survivor_from);
+    size_t bound = (heap_ptr - heap_start) + young;
+    if (bound > to_committed) {
+        commit_space(to_space, &to_committed, bound < vm_options.heap_max ? bound : vm_options.heap_max);
+    }
+    garbage_collector();
+
+    size_t need = (heap_ptr - heap_start) + request + NURSERY_SIZE;
+    size_t new_size = heap_size;
+    if (over_target(need, heap_size)) {
+        new_size = grown_size(need);
+    } else if (!over_target(2 * need, heap_size)) {
+        // Under half the target, halve while the target still holds
+        while (new_size / 2 >= vm_options.heap_initial && !over_target(need, new_size / 2)) {
+            new_size /= 2;
+        }
+    }
+    resize_heap(new_size);
+    if ((size_t)(heap_ptr - heap_start) + request > heap_size) {
+        out_of_memory();
+    }
+}
+
 void *halloc(int nbytes) {
     // Align to 8 bytes
     nbytes = (nbytes + 7) & ~7;
+    total_bytes += nbytes;
 
-    // Calculate current heap usage percentage
-    double usage_percentage = ((double)(heap_ptr - heap_start) / heap_size) * 100;
-
-    // If we don't have enough space for this allocation or usage is over 85%, try GC first
-    if (heap_ptr + nbytes > heap_start + heap_size || usage_percentage > 90.0) {
-        // printf("Before GC: usage is %.2f%%\n", usage_percentage);
-
-        // Try garbage collection
-        garbage_collector();
-
-        // Recalculate usage after GC
-        usage_percentage = ((double)(heap_ptr - heap_start) / heap_size) * 100;
-        // printf("After GC: usage is %.2f%%\n", usage_percentage);
-
-        // If after GC still over 70% or not enough space, expand heap
-        if (usage_percentage > 70.0 || heap_ptr + nbytes > heap_start + heap_size) {
-            // printf("Usage still high (%.2f%%) after GC, expanding heap\n", usage_percentage);
-            if (!expand_heap()) {
-                print_heap_objects();
-                fprintf(stderr, "Fatal: Memory exhausted. Cannot expand heap further.\n");
-                fprintf(stderr, "Current heap size: %zu bytes\n", heap_size);
-                fprintf(stderr, "Requested allocation: %d bytes\n", nbytes);
-                fprintf(stderr, "Available space: %ld bytes\n",
-                        (heap_start + heap_size) - heap_ptr);
-                exit(1);
-            }
+    // Large objects would only be copied through the nursery
+    if (nbytes > LARGE_OBJECT_SIZE) {
+        if (heap_ptr + nbytes > heap_start + (intptr_t)heap_size) {
+            major_collection(nbytes);
         }
+        void *result = (void *)heap_ptr;
+        heap_ptr += nbytes;
+        return result;
     }
 
-    total_bytes += nbytes;
-    void *result = (void *)heap_ptr;
-    heap_ptr += nbytes;
+    if (eden_ptr + nbytes > eden_end) {
+        minor_collection();
+    }
+    void *result = (void *)eden_ptr;
+    eden_ptr += nbytes;
     return result;
 }
 
@@ -362,8 +515,8 @@ void print_heap_objects() {
 
     intptr_t total_stack_size = 0;
     intptr_t total_null = 0;
-    for (int i = 0; i < vector_size(machine->stack); i++) {
-        intptr_t obj = (intptr_t)vector_get(machine->stack, i);
+    for (intptr_t *slot = machine->stack.base; slot < machine->stack.top; slot++) {
+        intptr_t obj = *slot;
         if (IS_NULL(obj)) {
             total_null++;
             continue;
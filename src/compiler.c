@@ -16,11 +16,13 @@ ScopeContext *newScopeContext(ScopeContext *prev) {
 
     if (prev != NULL) {
         context->instructions = prev->instructions;
+        context->lines = prev->lines;
         context->args = prev->args;
         context->nargs = prev->nargs;
         context->nlocals = prev->nlocals;
     } else {
         context->instructions = make_vector();
+        context->lines = make_vector();
         context->args = make_vector();
         context->nargs = 0;
         context->nlocals = 0;
@@ -66,7 +68,13 @@ MethodValue *newMethodValue(int name, int nargs, int nlocals, Vector *code) {
     rv->name = name;
     rv->nargs = nargs;
     rv->nlocals = nlocals;
-    rv->processed = 0;
+    rv->lines = NULL;
+    rv->ins = NULL;
+    rv->ins_lines = NULL;
+    rv->ninstr = 0;
+    rv->maxstack = 0;
+    rv->jit = NULL;
+    rv->profile = NULL;
     return rv;
 }
 
@@ -84,24 +92,143 @@ ClassValue *newClassValue(Vector *slots) {
     return rv;
 }
 
+// Number of var slots an object of the class pops as initial values
+static int classVarCount(Vector *pool, int class) {
+    ClassValue *classValue = (ClassValue *)vector_get(pool, class);
+    int count = 0;
+    for (int i = 0; i < vector_size(classValue->slots); i++) {
+        Value *v = (Value *)vector_get(pool, (int)(intptr_t)vector_get(classValue->slots, i));
+        if (v->tag == SLOT_VAL) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Net change of the operand stack depth when the instruction executes
+static int stackEffect(CompileInfo *info, ByteIns *ins) {
+    switch (ins->tag) {
+    case LIT_OP:
+    case GET_LOCAL_OP:
+    case GET_GLOBAL_OP:
+        return 1;
+    case PRINTF_OP:
+        return -((PrintfIns *)ins)->arity;
+    case ARRAY_OP:
+    case SET_SLOT_OP:
+    case SET_LOCAL_OP:
+    case SET_GLOBAL_OP:
+    case BRANCH_OP:
+    case DROP_OP:
+        return -1;
+    case OBJECT_OP:
+        return -classVarCount(info->pool, ((ObjectIns *)ins)->class);
+    case CALL_OP:
+    case TAIL_CALL_OP:
+        return 1 - ((CallIns *)ins)->arity;
+    case CALL_SLOT_OP:
+    case TAIL_CALL_SLOT_OP:
+    case ADD_INT_OP:
+    case SUB_INT_OP:
+    case MUL_INT_OP:
+    case DIV_INT_OP:
+    case MOD_INT_OP:
+    case LT_INT_OP:
+    case GT_INT_OP:
+    case LE_INT_OP:
+    case GE_INT_OP:
+    case EQ_INT_OP:
+    case ARRAY_GET_OP:
+    case ARRAY_SET_OP:
+    case ARRAY_LEN_OP:
+        // Receiver and arguments are replaced by the result
+        return 1 - ((CallSlotIns *)ins)->arity;
+    default:
+        // LABEL, SLOT, GOTO and RETURN
+        return 0;
+    }
+}
+
+// Append an instruction to the current method and track its stack depth
+static void emit(CompileInfo *info, ByteIns *ins) {
+    vector_add(info->scopeContext->instructions, ins);
+    vector_add(info->scopeContext->lines, (void *)(intptr_t)info->line);
+    info->depth += stackEffect(info, ins);
+    if (info->depth > info->maxDepth) {
+        info->maxDepth = info->depth;
+    }
+}
+
 void addNullInstr(CompileInfo *info) {
     int nullIndex = addConstantValue(info->pool, (Value *)newNullValue());
     LitIns *nullInstr = (LitIns *)malloc(sizeof(LitIns));
     nullInstr->tag = LIT_OP;
     nullInstr->idx = nullIndex;
-    vector_add(info->scopeContext->instructions, nullInstr);
+    emit(info, (ByteIns *)nullInstr);
 }
 
 void addReturnInstr(CompileInfo *info) {
     ByteIns *return_ins = (ByteIns *)malloc(sizeof(ByteIns));
     return_ins->tag = RETURN_OP;
-    vector_add(info->scopeContext->instructions, return_ins);
+    emit(info, (ByteIns *)return_ins);
 }
 
 void addDropInstr(CompileInfo *info) {
     ByteIns *drop_ins = (ByteIns *)malloc(sizeof(ByteIns));
     drop_ins->tag = DROP_OP;
-    vector_add(info->scopeContext->instructions, drop_ins);
+    emit(info, (ByteIns *)drop_ins);
+}
+
+// Line table of a finished method for the vm's diagnostics
+static int *lineTable(ScopeContext *context) {
+    int n = vector_size(context->lines);
+    int *lines = (int *)malloc(sizeof(int) * (n + 1));
+    for (int i = 0; i < n; i++) {
+        lines[i] = (int)(intptr_t)vector_get(context->lines, i);
+    }
+    return lines;
+}
+
+static int findLabel(Vector *code, int name) {
+    for (int i = 0; i < vector_size(code); i++) {
+        ByteIns *ins = vector_get(code, i);
+        if (ins->tag == LABEL_OP && ((LabelIns *)ins)->name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Whether the code from i on returns without doing anything else
+static int reachesReturn(Vector *code, int i) {
+    // Bounded, jumps alone could go around in a circle
+    for (int hops = 0; i >= 0 && i < vector_size(code) && hops < vector_size(code); hops++) {
+        ByteIns *ins = vector_get(code, i);
+        switch (ins->tag) {
+        case RETURN_OP:
+            return 1;
+        case LABEL_OP:
+            i++;
+            break;
+        case GOTO_OP:
+            i = findLabel(code, ((GotoIns *)ins)->name);
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Turn the calls of a finished fn or method body whose result is returned as is
+// into tail calls
+static void markTailCalls(Vector *code) {
+    for (int i = 0; i < vector_size(code); i++) {
+        ByteIns *ins = vector_get(code, i);
+        if ((ins->tag == CALL_OP || ins->tag == CALL_SLOT_OP) && reachesReturn(code, i + 1)) {
+            ins->tag = ins->tag == CALL_OP ? TAIL_CALL_OP : TAIL_CALL_SLOT_OP;
+        }
+    }
 }
 
 static int compare_instructions(ByteIns *ins1, ByteIns *ins2) {
@@ -148,7 +275,21 @@ static int compare_instructions(ByteIns *ins1, ByteIns *ins2) {
         return s1->name - s2->name;
     }
 
-    case CALL_SLOT_OP: {
+    case CALL_SLOT_OP:
+    case TAIL_CALL_SLOT_OP:
+    case ADD_INT_OP:
+    case SUB_INT_OP:
+    case MUL_INT_OP:
+    case DIV_INT_OP:
+    case MOD_INT_OP:
+    case LT_INT_OP:
+    case GT_INT_OP:
+    case LE_INT_OP:
+    case GE_INT_OP:
+    case EQ_INT_OP:
+    case ARRAY_GET_OP:
+    case ARRAY_SET_OP:
+    case ARRAY_LEN_OP: {
         CallSlotIns *c1 = (CallSlotIns *)ins1;
         CallSlotIns *c2 = (CallSlotIns *)ins2;
         if (c1->name != c2->name)
@@ -156,7 +297,8 @@ static int compare_instructions(ByteIns *ins1, ByteIns *ins2) {
         return c1->arity - c2->arity;
     }
 
-    case CALL_OP: {
+    case CALL_OP:
+    case TAIL_CALL_OP: {
         CallIns *c1 = (CallIns *)ins1;
         CallIns *c2 = (CallIns *)ins2;
         if (c1->name != c2->name)
@@ -357,7 +499,7 @@ static void compileLiteral(CompileInfo *info, Value *value) {
     LitIns *lit = (LitIns *)malloc(sizeof(LitIns));
     lit->tag = LIT_OP;
     lit->idx = val_idx;
-    vector_add(info->scopeContext->instructions, lit);
+    emit(info, (ByteIns *)lit);
 }
 
 static void compilePrintf(CompileInfo *info, PrintfExp *printf_exp) {
@@ -372,7 +514,37 @@ static void compilePrintf(CompileInfo *info, PrintfExp *printf_exp) {
     printf_ins->tag = PRINTF_OP;
     printf_ins->format = format_idx;
     printf_ins->arity = printf_exp->nexps;
-    vector_add(info->scopeContext->instructions, printf_ins);
+    emit(info, (ByteIns *)printf_ins);
+}
+
+// Method calls that get an integer or array fast-path opcode
+static const struct {
+    const char *name;
+    int nargs;
+    OpCode op;
+} fastOps[] = {
+    {"add", 1, ADD_INT_OP},
+    {"sub", 1, SUB_INT_OP},
+    {"mul", 1, MUL_INT_OP},
+    {"div", 1, DIV_INT_OP},
+    {"mod", 1, MOD_INT_OP},
+    {"lt", 1, LT_INT_OP},
+    {"gt", 1, GT_INT_OP},
+    {"le", 1, LE_INT_OP},
+    {"ge", 1, GE_INT_OP},
+    {"eq", 1, EQ_INT_OP},
+    {"get", 1, ARRAY_GET_OP},
+    {"set", 2, ARRAY_SET_OP},
+    {"length", 0, ARRAY_LEN_OP},
+};
+
+static OpCode callSlotOpcode(CallSlotExp *call) {
+    for (int i = 0; i < (int)(sizeof(fastOps) / sizeof(fastOps[0])); i++) {
+        if (call->nargs == fastOps[i].nargs && strcmp(call->name, fastOps[i].name) == 0) {
+            return fastOps[i].op;
+        }
+    }
+    return CALL_SLOT_OP;
 }
 
 static void compileMethodCall(CompileInfo *info, CallSlotExp *call) {
@@ -385,10 +557,10 @@ static void compileMethodCall(CompileInfo *info, CallSlotExp *call) {
     int name_idx = addConstantValue(info->pool, (Value *)name);
 
     CallSlotIns *call_ins = (CallSlotIns *)malloc(sizeof(CallSlotIns));
-    call_ins->tag = CALL_SLOT_OP;
+    call_ins->tag = callSlotOpcode(call);
     call_ins->name = name_idx;
     call_ins->arity = call->nargs + 1;
-    vector_add(info->scopeContext->instructions, call_ins);
+    emit(info, (ByteIns *)call_ins);
 }
 
 static void compileFunctionCall(CompileInfo *info, CallExp *call) {
@@ -403,7 +575,7 @@ static void compileFunctionCall(CompileInfo *info, CallExp *call) {
     call_ins->tag = CALL_OP;
     call_ins->name = name_idx;
     call_ins->arity = call->nargs;
-    vector_add(info->scopeContext->instructions, call_ins);
+    emit(info, (ByteIns *)call_ins);
 }
 
 static void compileArray(CompileInfo *info, ArrayExp *array) {
@@ -413,7 +585,7 @@ static void compileArray(CompileInfo *info, ArrayExp *array) {
     }
     ByteIns *new_array = (ByteIns *)malloc(sizeof(ByteIns));
     new_array->tag = ARRAY_OP;
-    vector_add(info->scopeContext->instructions, new_array);
+    emit(info, (ByteIns *)new_array);
 }
 
 static void compileSlotAccess(CompileInfo *info, SlotExp *slot) {
@@ -425,7 +597,7 @@ static void compileSlotAccess(CompileInfo *info, SlotExp *slot) {
     SlotIns *slot_ins = (SlotIns *)malloc(sizeof(SlotIns));
     slot_ins->tag = SLOT_OP;
     slot_ins->name = name_idx;
-    vector_add(info->scopeContext->instructions, slot_ins);
+    emit(info, (ByteIns *)slot_ins);
 }
 
 static void compileSetSlot(CompileInfo *info, SetSlotExp *expr) {
@@ -438,7 +610,7 @@ static void compileSetSlot(CompileInfo *info, SetSlotExp *expr) {
     SetSlotIns *set_slot = (SetSlotIns *)malloc(sizeof(SetSlotIns));
     set_slot->tag = SET_SLOT_OP;
     set_slot->name = name_idx;
-    vector_add(info->scopeContext->instructions, set_slot);
+    emit(info, (ByteIns *)set_slot);
 }
 
 static void collectVarSlot(CompileInfo *info, SlotVar *var_slot) {
@@ -471,24 +643,33 @@ static void compileMethodSlot(CompileInfo *info, SlotMethod *method_slot) {
     int name_idx = addConstantValue(info->pool, (Value *)methodName);
 
     ScopeContext *prev_scope = info->scopeContext;
+    int prev_depth = info->depth;
+    int prev_max_depth = info->maxDepth;
 
     info->scopeContext = newScopeContext(NULL);
     info->scopeContext->nargs = method_slot->nargs + 1;
     info->scopeContext->nlocals = 0;
+    info->depth = 0;
+    info->maxDepth = 0;
 
     vector_add(info->scopeContext->args, (void *)strdup("this"));
     for (int i = 0; i < method_slot->nargs; i++) {
         vector_add(info->scopeContext->args, method_slot->args[i]);
     }
 
-    compileScope(info, method_slot->body);
+    compileScope(info, method_slot->body, 1);
     addReturnInstr(info);
+    markTailCalls(info->scopeContext->instructions);
 
     MethodValue *method = newMethodValue(
         name_idx,
         info->scopeContext->nargs,
         info->scopeContext->nlocals,
         info->scopeContext->instructions);
+    method->lines = lineTable(info->scopeContext);
+    method->maxstack = info->maxDepth;
+    info->depth = prev_depth;
+    info->maxDepth = prev_max_depth;
     int method_idx = addConstantValue(info->pool, (Value *)method);
     vector_add(info->objContext->names, name);
     vector_add(info->objContext->slots, (void *)(intptr_t)method_idx);
@@ -538,13 +719,14 @@ static void compileObject(CompileInfo *info, ObjectExp *obj) {
     ObjectIns *new_obj = (ObjectIns *)malloc(sizeof(ObjectIns));
     new_obj->tag = OBJECT_OP;
     new_obj->class = class_idx;
-    vector_add(info->scopeContext->instructions, new_obj);
+    emit(info, (ByteIns *)new_obj);
 
     info->objContext = obj_ctx->prev;
     free(obj_ctx);
 }
 
-static void compileIfExpr(CompileInfo *info, IfExp *ifExp) {
+// Both branches leave the if's value on the stack when it is needed
+static void compileIfExpr(CompileInfo *info, IfExp *ifExp, int needValue) {
     StringValue *conseq_label = newStringValue(genLabel());
     int conseq_idx = addConstantValue(info->pool, (Value *)conseq_label);
     StringValue *end_label = newStringValue(genLabel());
@@ -555,15 +737,16 @@ static void compileIfExpr(CompileInfo *info, IfExp *ifExp) {
     BranchIns *branch = (BranchIns *)malloc(sizeof(BranchIns));
     branch->tag = BRANCH_OP;
     branch->name = conseq_idx;
-    vector_add(info->scopeContext->instructions, branch);
+    emit(info, (ByteIns *)branch);
+    int branch_depth = info->depth;
 
     // Else block
-    if (ifExp->alt->tag == EXP_STMT && ((ScopeExp *)ifExp->alt)->exp->tag == NULL_EXP) {
+    if (!needValue && ifExp->alt->tag == EXP_STMT && ((ScopeExp *)ifExp->alt)->exp->tag == NULL_EXP) {
     } else {
         ScopeContext *alt_scope = newScopeContext(info->scopeContext);
         info->scopeContext = alt_scope;
 
-        compileScope(info, ifExp->alt);
+        compileScope(info, ifExp->alt, needValue);
 
         if (alt_scope->nlocals > alt_scope->prev->nlocals) {
             alt_scope->prev->nlocals = alt_scope->nlocals;
@@ -575,17 +758,19 @@ static void compileIfExpr(CompileInfo *info, IfExp *ifExp) {
     GotoIns *goto_end = (GotoIns *)malloc(sizeof(GotoIns));
     goto_end->tag = GOTO_OP;
     goto_end->name = end_idx;
-    vector_add(info->scopeContext->instructions, goto_end);
+    emit(info, (ByteIns *)goto_end);
 
     LabelIns *conseq_ins = (LabelIns *)malloc(sizeof(LabelIns));
     conseq_ins->tag = LABEL_OP;
     conseq_ins->name = conseq_idx;
-    vector_add(info->scopeContext->instructions, conseq_ins);
+    emit(info, (ByteIns *)conseq_ins);
 
+    // The consequence starts from the depth at the branch
+    info->depth = branch_depth;
     ScopeContext *conseq_scope = newScopeContext(info->scopeContext);
     info->scopeContext = conseq_scope;
 
-    compileScope(info, ifExp->conseq);
+    compileScope(info, ifExp->conseq, needValue);
 
     if (conseq_scope->nlocals > conseq_scope->prev->nlocals) {
         conseq_scope->prev->nlocals = conseq_scope->nlocals;
@@ -596,9 +781,10 @@ static void compileIfExpr(CompileInfo *info, IfExp *ifExp) {
     LabelIns *end_ins = (LabelIns *)malloc(sizeof(LabelIns));
     end_ins->tag = LABEL_OP;
     end_ins->name = end_idx;
-    vector_add(info->scopeContext->instructions, end_ins);
+    emit(info, (ByteIns *)end_ins);
 }
 
+// The loop itself leaves nothing on the stack, its body is compiled for effect
 static void compileWhileExpr(CompileInfo *info, WhileExp *whileExp) {
     StringValue *loop_label = newStringValue(genLabel());
     int loop_idx = addConstantValue(info->pool, (Value *)loop_label);
@@ -608,17 +794,17 @@ static void compileWhileExpr(CompileInfo *info, WhileExp *whileExp) {
     GotoIns *goto_loop = (GotoIns *)malloc(sizeof(GotoIns));
     goto_loop->tag = GOTO_OP;
     goto_loop->name = loop_idx;
-    vector_add(info->scopeContext->instructions, goto_loop);
+    emit(info, (ByteIns *)goto_loop);
 
     LabelIns *body_ins = (LabelIns *)malloc(sizeof(LabelIns));
     body_ins->tag = LABEL_OP;
     body_ins->name = body_idx;
-    vector_add(info->scopeContext->instructions, body_ins);
+    emit(info, (ByteIns *)body_ins);
 
     ScopeContext *body_scope = newScopeContext(info->scopeContext);
     info->scopeContext = body_scope;
 
-    compileScope(info, whileExp->body);
+    compileScope(info, whileExp->body, 0);
 
     if (body_scope->nlocals > body_scope->prev->nlocals) {
         body_scope->prev->nlocals = body_scope->nlocals;
@@ -629,14 +815,14 @@ static void compileWhileExpr(CompileInfo *info, WhileExp *whileExp) {
     LabelIns *loop_ins = (LabelIns *)malloc(sizeof(LabelIns));
     loop_ins->tag = LABEL_OP;
     loop_ins->name = loop_idx;
-    vector_add(info->scopeContext->instructions, loop_ins);
+    emit(info, (ByteIns *)loop_ins);
 
     compileExpr(info, whileExp->pred);
 
     BranchIns *branch = (BranchIns *)malloc(sizeof(BranchIns));
     branch->tag = BRANCH_OP;
     branch->name = body_idx;
-    vector_add(info->scopeContext->instructions, branch);
+    emit(info, (ByteIns *)branch);
 }
 
 static void compileRefExpr(CompileInfo *info, RefExp *ref) {
@@ -645,7 +831,7 @@ static void compileRefExpr(CompileInfo *info, RefExp *ref) {
         GetLocalIns *get = (GetLocalIns *)malloc(sizeof(GetLocalIns));
         get->tag = GET_LOCAL_OP;
         get->idx = local_idx;
-        vector_add(info->scopeContext->instructions, get);
+        emit(info, (ByteIns *)get);
         return;
     }
 
@@ -657,14 +843,14 @@ static void compileRefExpr(CompileInfo *info, RefExp *ref) {
             SlotIns *get = (SlotIns *)malloc(sizeof(SlotIns));
             get->tag = SLOT_OP;
             get->name = name_idx;
-            vector_add(info->scopeContext->instructions, get);
+            emit(info, (ByteIns *)get);
         } else {
             StringValue *varName = newStringValue(ref->name);
             int name_idx = addConstantValue(info->pool, (Value *)varName);
             GetGlobalIns *get = (GetGlobalIns *)malloc(sizeof(GetGlobalIns));
             get->tag = GET_GLOBAL_OP;
             get->name = name_idx;
-            vector_add(info->scopeContext->instructions, get);
+            emit(info, (ByteIns *)get);
         }
         return;
     }
@@ -682,7 +868,7 @@ static void compileSetExpr(CompileInfo *info, SetExp *setExp) {
         SetLocalIns *set_local = (SetLocalIns *)malloc(sizeof(SetLocalIns));
         set_local->tag = SET_LOCAL_OP;
         set_local->idx = local_idx;
-        vector_add(info->scopeContext->instructions, set_local);
+        emit(info, (ByteIns *)set_local);
     } else {
         VarLocation loc = findObjVar(info->objContext, setExp->name);
 
@@ -693,12 +879,12 @@ static void compileSetExpr(CompileInfo *info, SetExp *setExp) {
                 SetGlobalIns *set_global = (SetGlobalIns *)malloc(sizeof(SetGlobalIns));
                 set_global->tag = SET_GLOBAL_OP;
                 set_global->name = name_idx;
-                vector_add(info->scopeContext->instructions, set_global);
+                emit(info, (ByteIns *)set_global);
             } else { // SLOT_VAR
                 SetSlotIns *set_slot = (SetSlotIns *)malloc(sizeof(SetSlotIns));
                 set_slot->tag = SET_SLOT_OP;
                 set_slot->name = name_idx;
-                vector_add(info->scopeContext->instructions, set_slot);
+                emit(info, (ByteIns *)set_slot);
             }
         } else {
             fprintf(stderr, "Error: Undefined variable '%s' in assignment\n", setExp->name);
@@ -724,7 +910,7 @@ static void compileVarStmt(CompileInfo *info, ScopeVar *varStmt) {
             SetGlobalIns *set_ins = (SetGlobalIns *)malloc(sizeof(SetGlobalIns));
             set_ins->tag = SET_GLOBAL_OP;
             set_ins->name = name_idx;
-            vector_add(info->scopeContext->instructions, set_ins);
+            emit(info, (ByteIns *)set_ins);
         }
     } else {
         StringValue *name = newStringValue(strdup(varStmt->name));
@@ -739,7 +925,7 @@ static void compileVarStmt(CompileInfo *info, ScopeVar *varStmt) {
             SetLocalIns *set_ins = (SetLocalIns *)malloc(sizeof(SetLocalIns));
             set_ins->tag = SET_LOCAL_OP;
             set_ins->idx = local_idx;
-            vector_add(info->scopeContext->instructions, set_ins);
+            emit(info, (ByteIns *)set_ins);
         }
     }
 }
@@ -761,7 +947,9 @@ static void compileExpr(CompileInfo *info, Exp *expr) {
         compileArray(info, (ArrayExp *)expr);
         break;
     case PRINTF_EXP:
+        // printf leaves nothing on the stack, its value is null
         compilePrintf(info, (PrintfExp *)expr);
+        addNullInstr(info);
         break;
     case OBJECT_EXP:
         compileObject(info, (ObjectExp *)expr);
@@ -778,14 +966,20 @@ static void compileExpr(CompileInfo *info, Exp *expr) {
     case CALL_EXP:
         compileFunctionCall(info, (CallExp *)expr);
         break;
-    case SET_EXP:
-        compileSetExpr(info, (SetExp *)expr);
+    case SET_EXP: {
+        // The stored value is the value of the assignment
+        SetExp *setExp = (SetExp *)expr;
+        RefExp ref = {REF_EXP, setExp->name};
+        compileSetExpr(info, setExp);
+        compileRefExpr(info, &ref);
         break;
+    }
     case IF_EXP:
-        compileIfExpr(info, (IfExp *)expr);
+        compileIfExpr(info, (IfExp *)expr, 1);
         break;
     case WHILE_EXP:
         compileWhileExpr(info, (WhileExp *)expr);
+        addNullInstr(info);
         break;
     case REF_EXP:
         compileRefExpr(info, (RefExp *)expr);
@@ -796,6 +990,28 @@ static void compileExpr(CompileInfo *info, Exp *expr) {
     }
 }
 
+// Compile an expression whose value is not used, leaving the stack unchanged
+static void compileEffect(CompileInfo *info, Exp *expr) {
+    switch (expr->tag) {
+    case PRINTF_EXP:
+        compilePrintf(info, (PrintfExp *)expr);
+        break;
+    case SET_EXP:
+        compileSetExpr(info, (SetExp *)expr);
+        break;
+    case IF_EXP:
+        compileIfExpr(info, (IfExp *)expr, 0);
+        break;
+    case WHILE_EXP:
+        compileWhileExpr(info, (WhileExp *)expr);
+        break;
+    default:
+        compileExpr(info, expr);
+        addDropInstr(info);
+        break;
+    }
+}
+
 static void compileFnStmt(CompileInfo *info, ScopeFn *fnStmt) {
     StringValue *name = newStringValue(strdup(fnStmt->name));
     int name_idx = addConstantValue(info->pool, (Value *)name);
@@ -807,15 +1023,24 @@ static void compileFnStmt(CompileInfo *info, ScopeFn *fnStmt) {
         vector_add(fn_ctx->args, fnStmt->args[i]);
     }
     info->scopeContext = fn_ctx;
+    int old_depth = info->depth;
+    int old_max_depth = info->maxDepth;
+    info->depth = 0;
+    info->maxDepth = 0;
 
-    compileScope(info, fnStmt->body);
+    compileScope(info, fnStmt->body, 1);
     addReturnInstr(info);
+    markTailCalls(fn_ctx->instructions);
 
     MethodValue *method = newMethodValue(
         name_idx,
         fn_ctx->nargs,
         fn_ctx->nlocals,
         fn_ctx->instructions);
+    method->lines = lineTable(fn_ctx);
+    method->maxstack = info->maxDepth;
+    info->depth = old_depth;
+    info->maxDepth = old_max_depth;
 
     int method_idx = addConstantValue(info->pool, (Value *)method);
 
@@ -828,31 +1053,49 @@ static void compileFnStmt(CompileInfo *info, ScopeFn *fnStmt) {
     free(fn_ctx);
 }
 
-static void compileScope(CompileInfo *info, ScopeStmt *stmt) {
+// Compile a statement, leaving its value on the stack only when it is needed
+static void compileScope(CompileInfo *info, ScopeStmt *stmt, int needValue) {
+    // Code of the statement maps to its line, code after it back to the enclosing one
+    int prevLine = info->line;
+    if (stmt->line > 0) {
+        info->line = stmt->line;
+    }
+
     switch (stmt->tag) {
     case VAR_STMT:
         compileVarStmt(info, (ScopeVar *)stmt);
+        if (needValue) {
+            addNullInstr(info);
+        }
         break;
 
     case FN_STMT:
         compileFnStmt(info, (ScopeFn *)stmt);
+        if (needValue) {
+            addNullInstr(info);
+        }
         break;
 
     case SEQ_STMT: {
         ScopeSeq *seq = (ScopeSeq *)stmt;
-        compileScope(info, seq->a);
-        compileScope(info, seq->b);
+        compileScope(info, seq->a, 0);
+        compileScope(info, seq->b, needValue);
         break;
     }
 
     case EXP_STMT:
-        compileExpr(info, ((ScopeExp *)stmt)->exp);
+        if (needValue) {
+            compileExpr(info, ((ScopeExp *)stmt)->exp);
+        } else {
+            compileEffect(info, ((ScopeExp *)stmt)->exp);
+        }
         break;
 
     default:
         fprintf(stderr, "Unknown statement type: %d\n", stmt->tag);
         break;
     }
+    info->line = prevLine;
 }
 
 void interpret_bc(Program *p) {
@@ -870,9 +1113,12 @@ Program *compile(ScopeStmt *stmt) {
     info->scopeContext = newScopeContext(NULL);
     info->scopeContext->flag = GLOBAL;
     info->objContext = newObjContext();
+    info->depth = 0;
+    info->maxDepth = 0;
+    info->line = 0;
 
     // Compile program from global level
-    compileScope(info, stmt);
+    compileScope(info, stmt, 0);
 
     // Add return to entry function
     addReturnInstr(info);
@@ -881,8 +1127,10 @@ Program *compile(ScopeStmt *stmt) {
     char *str = (char *)malloc(strlen("42entry24") + 1);
     strcpy(str, "42entry24");
     int nameIndex = addConstantValue(info->pool, (Value *)newStringValue(str));
-    int entryIndex = addConstantValue(info->pool,
-                                      (Value *)newMethodValue(nameIndex, 0, 0, info->scopeContext->instructions));
+    MethodValue *entry = newMethodValue(nameIndex, 0, 0, info->scopeContext->instructions);
+    entry->lines = lineTable(info->scopeContext);
+    entry->maxstack = info->maxDepth;
+    int entryIndex = addConstantValue(info->pool, (Value *)entry);
 
     prog->entry = entryIndex;
     prog->values = info->pool;
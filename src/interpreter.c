@@ -346,19 +346,14 @@ Obj *eval_exp(EnvObj *env, Exp *exp) {
         }
 
         // Replace all ~ with acutal value
-        if (check_print_exp_args_num(e->format, e->nexps) == STATUS_OK) {
-            char *format = e->format;
-            int value_index = 0;
-            while (*format != '\0') {
-                if (*format == '~') {
-                    Obj *value = values[value_index++];
-                    printf("%d", ((IntObj *)value)->value);
-                } else {
-                    putchar(*format);
-                }
-                format++;
-            }
+        if (!e->compiled && check_print_exp_args_num(e->format, e->nexps) == STATUS_OK) {
+            e->compiled = compile_format(e->format);
+        }
+        long args[e->nexps + 1];
+        for (int i = 0; i < e->nexps; i++) {
+            args[i] = ((IntObj *)values[i])->value;
         }
+        output_format(e->compiled, args);
 
         return (Obj *)make_null_obj();
     }
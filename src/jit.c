@@ -0,0 +1,436 @@
+#include "feeny/jit.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include "feeny/x86.h"
+
+/*
+ * Register usage of the generated code
+ *   rbx: operand stack top (machine->stack.top while native code runs)
+ *   r12: locals of the current frame
+ *   r14: machine
+ *   r15: current frame, to detect when a handler switched frames
+ * All four are callee-saved, so they survive calls into the vm's handlers.
+ * rax, rcx, rdx, rsi and rdi are scratch.
+ */
+
+// A branch whose rel32 at `pos` still has to point at instruction `target`
+typedef struct {
+    size_t pos;
+    int target;
+} Fixup;
+
+// Call handler(machine, ins), with the stack top spilled around the call
+static void emitHandlerCall(Asm *a, void *handler, Instr *ins) {
+    emitStore(a, R14, MACHINE_OFFSET(stack.top), RBX);
+    emitRegReg(a, 0x89, R14, RDI);
+    emitMovImm(a, RSI, (int64_t)(intptr_t)ins);
+    emitCall(a, handler);
+    emitLoad(a, RBX, R14, MACHINE_OFFSET(stack.top));
+}
+
+// Calls set machine->ip, a handler that pushes a frame returns to it later
+static void emitSetIp(Asm *a, int ip) {
+    emitMovImm(a, RAX, ip);
+    emitStore(a, R14, MACHINE_OFFSET(ip), RAX);
+}
+
+// Leave native code when the handler switched frames, the trampoline then
+// enters the new current frame
+static void emitExitOnFrameSwitch(Asm *a, size_t exitPos) {
+    emitMem(a, 0x3B, R15, R14, MACHINE_OFFSET(cur)); // cmp r15, [r14 + cur]
+    patchJump(a, emitJump(a, CC_NE), exitPos);
+}
+
+// Generic call-slot at ip, also the slow path of the int and array operations
+static void emitSend(Asm *a, Instr *ins, int ip, size_t exitPos) {
+    emitSetIp(a, ip);
+    emitHandlerCall(a, handle_call_slot_instr, ins);
+    emitExitOnFrameSwitch(a, exitPos);
+}
+
+// Pop y, x and push x op y for tagged ints, sending the call-slot otherwise
+static void emitIntOp(Asm *a, Instr *ins, int ip, size_t exitPos) {
+    emitLoad(a, RAX, RBX, -16);
+    emitLoad(a, RCX, RBX, -8);
+    emitRegReg(a, 0x89, RAX, RDX);
+    emitRegReg(a, 0x09, RCX, RDX); // or rdx, rcx
+    emitByte(a, 0xF6);
+    emitByte(a, 0xC2);
+    emitByte(a, TAG_MASK); // test dl, TAG_MASK
+    size_t slow = emitJump(a, CC_NE);
+
+    OpCode op = base_opcode(ins->op);
+    switch (op) {
+    case ADD_INT_OP:
+        emitRegReg(a, 0x01, RCX, RAX);
+        break;
+    case SUB_INT_OP:
+        emitRegReg(a, 0x29, RCX, RAX);
+        break;
+    case MUL_INT_OP:
+        // f(x*y) = f(x) * y
+        emitShift(a, 7, RCX, TAG_BITS);
+        emitOp0F(a, 0xAF, RAX, RCX);
+        break;
+    case DIV_INT_OP:
+    case MOD_INT_OP:
+        emitShift(a, 7, RAX, TAG_BITS);
+        emitShift(a, 7, RCX, TAG_BITS);
+        emitByte(a, 0x48);
+        emitByte(a, 0x99); // cqo
+        emitRex(a, 0, RCX);
+        emitByte(a, 0xF7);
+        emitByte(a, 0xF9); // idiv rcx
+        if (op == MOD_INT_OP) {
+            emitRegReg(a, 0x89, RDX, RAX);
+        }
+        emitShift(a, 4, RAX, TAG_BITS);
+        break;
+    default: {
+        // Comparisons yield int 0 for true and null for false
+        int cc = op == LT_INT_OP ? CC_L : op == GT_INT_OP ? CC_G : op == LE_INT_OP ? CC_LE : op == GE_INT_OP ? CC_GE : CC_E;
+        emitRegReg(a, 0x39, RCX, RAX); // cmp rax, rcx
+        emitByte(a, 0xB8 + RAX);
+        emitInt32(a, NULL_TAG); // mov eax, NULL_TAG
+        emitByte(a, 0xB8 + RDX);
+        emitInt32(a, 0); // mov edx, 0
+        emitOp0F(a, 0x40 + cc, RAX, RDX);
+        break;
+    }
+    }
+    emitStore(a, RBX, -16, RAX);
+    emitAluImm8(a, 5, RBX, 8);
+    size_t done = emitJump(a, -1);
+
+    patchJump(a, slow, a->len);
+    emitSend(a, ins, ip, exitPos);
+    patchJump(a, done, a->len);
+}
+
+// rcx = untagged array at [rbx + disp], jumping to `slow` unless it is an array
+static void emitArrayCheck(Asm *a, int32_t disp, size_t *slow) {
+    emitLoad(a, RCX, RBX, disp);
+    emitRegReg(a, 0x89, RCX, RDX);
+    emitByte(a, 0x83);
+    emitByte(a, 0xE2);
+    emitByte(a, TAG_MASK); // and edx, TAG_MASK
+    emitByte(a, 0x83);
+    emitByte(a, 0xFA);
+    emitByte(a, HEAP_TAG); // cmp edx, HEAP_TAG
+    slow[0] = emitJump(a, CC_NE);
+    emitAluImm8(a, 5, RCX, HEAP_TAG);
+    emitByte(a, 0x66);
+    emitByte(a, 0x83);
+    emitByte(a, 0x39);
+    emitByte(a, ARRAY_TYPE); // cmp word [rcx], ARRAY_TYPE, the header's type
+    slow[1] = emitJump(a, CC_NE);
+}
+
+// rdx = untagged index at [rbx + disp] of the array in rcx, jumping to `slow`
+// when it is not an int or out of bounds; the slow path reports the error
+static void emitIndexCheck(Asm *a, int32_t disp, size_t *slow) {
+    emitLoad(a, RDX, RBX, disp);
+    emitByte(a, 0xF6);
+    emitByte(a, 0xC2);
+    emitByte(a, TAG_MASK); // test dl, TAG_MASK
+    slow[0] = emitJump(a, CC_NE);
+    emitShift(a, 7, RDX, TAG_BITS);
+    emitMem(a, 0x3B, RDX, RCX, (int32_t)offsetof(RArray, length)); // cmp rdx, [rcx + length]
+    slow[1] = emitJump(a, CC_AE); // Unsigned, also catches negative indices
+}
+
+// Write barrier of the store of rax into the array in rcx, heap values
+// call into the collector
+static void emitWriteBarrier(Asm *a) {
+    emitRegReg(a, 0x89, RAX, RDX);
+    emitByte(a, 0x83);
+    emitByte(a, 0xE2);
+    emitByte(a, TAG_MASK); // and edx, TAG_MASK
+    emitByte(a, 0x83);
+    emitByte(a, 0xFA);
+    emitByte(a, HEAP_TAG); // cmp edx, HEAP_TAG
+    size_t skip = emitJump(a, CC_NE);
+    emitRegReg(a, 0x89, RCX, RDI);
+    emitRegReg(a, 0x89, RAX, RSI);
+    emitCall(a, write_barrier_call);
+    patchJump(a, skip, a->len);
+}
+
+// Array intrinsics inline the accesses of in-bounds int indices
+static void emitArrayOp(Asm *a, Instr *ins, int ip, size_t exitPos) {
+    size_t slow[4];
+    int nslow = 2;
+    switch (ins->op) {
+    case ARRAY_GET_OP:
+        emitArrayCheck(a, -16, slow);
+        emitIndexCheck(a, -8, slow + 2);
+        nslow = 4;
+        emitByte(a, 0x48);
+        emitByte(a, 0x8B);
+        emitByte(a, 0x44);
+        emitByte(a, 0xD1);
+        emitByte(a, offsetof(RArray, slots)); // mov rax, [rcx + rdx * 8 + slots]
+        emitStore(a, RBX, -16, RAX);
+        emitAluImm8(a, 5, RBX, 8);
+        break;
+    case ARRAY_SET_OP:
+        emitArrayCheck(a, -24, slow);
+        emitIndexCheck(a, -16, slow + 2);
+        nslow = 4;
+        emitLoad(a, RAX, RBX, -8);
+        emitByte(a, 0x48);
+        emitByte(a, 0x89);
+        emitByte(a, 0x44);
+        emitByte(a, 0xD1);
+        emitByte(a, offsetof(RArray, slots)); // mov [rcx + rdx * 8 + slots], rax
+        emitWriteBarrier(a);
+        // Like the generic set, leaves null on the stack
+        emitMovImm(a, RAX, NULL_TAG);
+        emitStore(a, RBX, -24, RAX);
+        emitAluImm8(a, 5, RBX, 16);
+        break;
+    default:
+        emitArrayCheck(a, -8, slow);
+        emitLoad(a, RAX, RCX, (int32_t)offsetof(RArray, length));
+        emitShift(a, 4, RAX, TAG_BITS);
+        emitStore(a, RBX, -8, RAX);
+        break;
+    }
+    size_t done = emitJump(a, -1);
+
+    for (int i = 0; i < nslow; i++) {
+        patchJump(a, slow[i], a->len);
+    }
+    emitSend(a, ins, ip, exitPos);
+    patchJump(a, done, a->len);
+}
+
+static void compileInstr(Asm *a, Instr *ins, int ip, size_t exitPos, Fixup *fixups, int *nfixups) {
+    OpCode op = base_opcode(ins->op);
+    switch (op) {
+    case LIT_OP:
+        emitMovImm(a, RAX, ins->arg);
+        emitStore(a, RBX, 0, RAX);
+        emitAluImm8(a, 0, RBX, 8);
+        break;
+
+    case GET_LOCAL_OP:
+        emitLoad(a, RAX, R12, (int32_t)(sizeof(intptr_t) * ins->arg));
+        emitStore(a, RBX, 0, RAX);
+        emitAluImm8(a, 0, RBX, 8);
+        break;
+
+    case SET_LOCAL_OP:
+        emitAluImm8(a, 5, RBX, 8);
+        emitLoad(a, RAX, RBX, 0);
+        emitStore(a, R12, (int32_t)(sizeof(intptr_t) * ins->arg), RAX);
+        break;
+
+    case GET_GLOBAL_OP:
+        // The global object moves during collections, load it every time
+        emitLoad(a, RCX, R14, MACHINE_OFFSET(global));
+        emitLoad(a, RAX, RCX, (int32_t)(offsetof(RClass, var_slots) + sizeof(intptr_t) * ins->arg));
+        emitStore(a, RBX, 0, RAX);
+        emitAluImm8(a, 0, RBX, 8);
+        break;
+
+    case SET_GLOBAL_OP:
+        emitAluImm8(a, 5, RBX, 8);
+        emitLoad(a, RAX, RBX, 0);
+        emitLoad(a, RCX, R14, MACHINE_OFFSET(global));
+        emitStore(a, RCX, (int32_t)(offsetof(RClass, var_slots) + sizeof(intptr_t) * ins->arg), RAX);
+        break;
+
+    case DROP_OP:
+        emitAluImm8(a, 5, RBX, 8);
+        break;
+
+    case BRANCH_OP:
+        emitAluImm8(a, 5, RBX, 8);
+        emitLoad(a, RAX, RBX, 0);
+        emitByte(a, 0x48);
+        emitByte(a, 0x83);
+        emitByte(a, 0xF8);
+        emitByte(a, NULL_TAG); // cmp rax, NULL_TAG
+        fixups[*nfixups].pos = emitJump(a, CC_NE);
+        fixups[*nfixups].target = (int)ins->arg;
+        (*nfixups)++;
+        break;
+
+    case GOTO_OP:
+        fixups[*nfixups].pos = emitJump(a, -1);
+        fixups[*nfixups].target = (int)ins->arg;
+        (*nfixups)++;
+        break;
+
+    case PRINTF_OP:
+        emitHandlerCall(a, handle_print_instr, ins);
+        break;
+
+    case ARRAY_OP:
+        emitHandlerCall(a, handle_array_instr, ins);
+        break;
+
+    case OBJECT_OP:
+        emitHandlerCall(a, handle_object_instr, ins);
+        break;
+
+    case SLOT_OP:
+        emitHandlerCall(a, handle_slot_instr, ins);
+        break;
+
+    case SET_SLOT_OP:
+        emitHandlerCall(a, handle_set_slot_instr, ins);
+        break;
+
+    case ADD_INT_OP:
+    case SUB_INT_OP:
+    case MUL_INT_OP:
+    case DIV_INT_OP:
+    case MOD_INT_OP:
+    case LT_INT_OP:
+    case GT_INT_OP:
+    case LE_INT_OP:
+    case GE_INT_OP:
+    case EQ_INT_OP:
+        emitIntOp(a, ins, ip, exitPos);
+        break;
+
+    case ARRAY_GET_OP:
+    case ARRAY_SET_OP:
+    case ARRAY_LEN_OP:
+        emitArrayOp(a, ins, ip, exitPos);
+        break;
+
+    case CALL_SLOT_OP:
+        emitSend(a, ins, ip, exitPos);
+        break;
+
+    case CALL_OP:
+        emitSetIp(a, ip);
+        emitHandlerCall(a, ins->op == CALL_DIRECT_OP ? handle_call_direct_instr : handle_call_instr, ins);
+        patchJump(a, emitJump(a, -1), exitPos);
+        break;
+
+    // A tail call keeps the current frame, so always leave through the
+    // trampoline, which enters the code at machine->ip
+    case TAIL_CALL_SLOT_OP:
+        emitSetIp(a, ip);
+        emitHandlerCall(a, handle_tail_call_slot_instr, ins);
+        patchJump(a, emitJump(a, -1), exitPos);
+        break;
+
+    case TAIL_CALL_OP:
+        emitSetIp(a, ip);
+        emitHandlerCall(a, ins->op == TAIL_CALL_DIRECT_OP ? handle_tail_call_direct_instr : handle_tail_call_instr, ins);
+        patchJump(a, emitJump(a, -1), exitPos);
+        break;
+
+    case RETURN_OP:
+        emitHandlerCall(a, handle_return_instr, ins);
+        patchJump(a, emitJump(a, -1), exitPos);
+        break;
+
+    default:
+        fprintf(stderr, "Error: jit cannot compile instruction: %d\n", ins->op);
+        exit(1);
+    }
+}
+
+/*
+ * Method layout
+ *   enter(entry): prologue, then jumps to the native code of instruction ip
+ *   exit:         spills the stack top and returns to the trampoline
+ *   body:         the templates of all instructions in order
+ */
+static JitCode *compileMethod(Machine *machine, MethodValue *method) {
+    Asm a;
+    initAsm(&a, 256 + 64 * (size_t)method->ninstr);
+    size_t *offsets = (size_t *)malloc(sizeof(size_t) * method->ninstr);
+    Fixup *fixups = (Fixup *)malloc(sizeof(Fixup) * method->ninstr);
+    int nfixups = 0;
+    if (!offsets || !fixups) {
+        fprintf(stderr, "Memory allocation failed for jit buffer\n");
+        exit(1);
+    }
+
+    // Prologue: save callee-saved registers, keep the stack 16-byte aligned
+    emitByte(&a, 0x55); // push rbp
+    emitByte(&a, 0x53); // push rbx
+    emitByte(&a, 0x41);
+    emitByte(&a, 0x54); // push r12
+    emitByte(&a, 0x41);
+    emitByte(&a, 0x55); // push r13
+    emitByte(&a, 0x41);
+    emitByte(&a, 0x56); // push r14
+    emitByte(&a, 0x41);
+    emitByte(&a, 0x57); // push r15
+    emitAluImm8(&a, 5, RSP, 8);
+    emitMovImm(&a, R14, (int64_t)(intptr_t)machine);
+    emitLoad(&a, RBX, R14, MACHINE_OFFSET(stack.top));
+    emitLoad(&a, R15, R14, MACHINE_OFFSET(cur));
+    emitRegReg(&a, 0x89, R15, R12);
+    emitAluImm8(&a, 0, R12, (int8_t)offsetof(Frame, locals));
+    emitByte(&a, 0xFF);
+    emitByte(&a, 0xE7); // jmp rdi
+
+    size_t exitPos = a.len;
+    emitStore(&a, R14, MACHINE_OFFSET(stack.top), RBX);
+    emitAluImm8(&a, 0, RSP, 8);
+    emitByte(&a, 0x41);
+    emitByte(&a, 0x5F); // pop r15
+    emitByte(&a, 0x41);
+    emitByte(&a, 0x5E); // pop r14
+    emitByte(&a, 0x41);
+    emitByte(&a, 0x5D); // pop r13
+    emitByte(&a, 0x41);
+    emitByte(&a, 0x5C); // pop r12
+    emitByte(&a, 0x5B); // pop rbx
+    emitByte(&a, 0x5D); // pop rbp
+    emitByte(&a, 0xC3); // ret
+
+    for (int i = 0; i < method->ninstr; i++) {
+        offsets[i] = a.len;
+        compileInstr(&a, &method->ins[i], i, exitPos, fixups, &nfixups);
+    }
+    for (int i = 0; i < nfixups; i++) {
+        patchJump(&a, fixups[i].pos, offsets[fixups[i].target]);
+    }
+
+    JitCode *jit = (JitCode *)malloc(sizeof(JitCode));
+    jit->code = finishAsm(&a, &jit->size);
+    jit->entries = (void **)malloc(sizeof(void *) * method->ninstr);
+    for (int i = 0; i < method->ninstr; i++) {
+        jit->entries[i] = (char *)jit->code + offsets[i];
+    }
+
+    free(offsets);
+    free(fixups);
+    return jit;
+}
+
+typedef void (*JitEnter)(void *entry);
+
+void jit_run(Machine *machine) {
+    // Native code returns here whenever the current frame changes
+    while (machine->cur) {
+        MethodValue *method = machine->cur->method;
+        if (!method->jit) {
+            method->jit = compileMethod(machine, method);
+        }
+        JitCode *jit = (JitCode *)method->jit;
+        ((JitEnter)jit->code)(jit->entries[machine->ip]);
+    }
+}
+
+#else
+
+void jit_run(Machine *machine) {
+    fprintf(stderr, "Error: the jit is only supported on x86-64 Linux\n");
+    exit(1);
+}
+
+#endif
@@ -0,0 +1,353 @@
+#include "feeny/linker.h"
+#include "feeny/output.h"
+#include "feeny/trace.h"
+
+static char *poolString(Machine *machine, int index, const char *what) {
+    Value *v = vector_get(machine->program->values, index);
+    if (v->tag != STRING_VAL) {
+        fprintf(stderr, "Error: %s must be string value!\n", what);
+        exit(1);
+    }
+    return ((StringValue *)v)->value;
+}
+
+static TClass *findClassByPoolIndex(Machine *machine, int index) {
+    for (int i = 0; i < vector_size(machine->classes); i++) {
+        TClass *templateClass = (TClass *)vector_get(machine->classes, i);
+        if (templateClass->poolIndex == index) {
+            return templateClass;
+        }
+    }
+    return NULL;
+}
+
+static SlotCache *newSlotCache() {
+    SlotCache *cache = (SlotCache *)malloc(sizeof(SlotCache));
+    cache->type = BROKEN_HEART; // Never the type of a live receiver
+    cache->index = -1;
+    return cache;
+}
+
+// Globals live in the global template's slots, resolve their index once
+static int globalSlotIndex(Machine *machine, int name) {
+    char *global = poolString(machine, name, "Global variable");
+    TClass *globalTemplate = (TClass *)vector_get(machine->classes, 0);
+    for (int i = 0; i < vector_size(globalTemplate->varNames); i++) {
+        if (strcmp(global, (char *)vector_get(globalTemplate->varNames, i)) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "Error: Undefined global variable %s\n", global);
+    exit(1);
+}
+
+// Map every label name of the method to the offset of the instruction that
+// follows it in the linked code, where labels themselves are left out
+static Map *collectLabels(Machine *machine, MethodValue *method) {
+    Map *labels = newMap();
+    int offset = 0;
+    for (int i = 0; i < vector_size(method->code); i++) {
+        ByteIns *instr = vector_get(method->code, i);
+        if (instr->tag == LABEL_OP) {
+            char *name = poolString(machine, ((LabelIns *)instr)->name, "Label instruction's name");
+            // Tuple: string -> offset
+            addNewTuple(labels, name, (void *)(intptr_t)offset);
+        } else {
+            offset++;
+        }
+    }
+    return labels;
+}
+
+static intptr_t resolveLabel(Machine *machine, Map *labels, int name) {
+    char *label = poolString(machine, name, "Label instruction's name");
+    for (int i = 0; i < vector_size(labels->names); i++) {
+        if (strcmp(label, (char *)vector_get(labels->names, i)) == 0) {
+            return (intptr_t)vector_get(labels->values, i);
+        }
+    }
+    fprintf(stderr, "Error: Undefined label %s\n", label);
+    exit(1);
+}
+
+static void linkInstr(Machine *machine, Map *labels, ByteIns *src, Instr *dst) {
+    dst->op = src->tag;
+    dst->arity = 0;
+    dst->arg = 0;
+    dst->ref = NULL;
+    dst->cache = NULL;
+
+    switch (src->tag) {
+    case ARRAY_OP:
+    case RETURN_OP:
+    case DROP_OP:
+        break;
+
+    case LIT_OP: {
+        Value *value = vector_get(machine->program->values, ((LitIns *)src)->idx);
+        if (value->tag != INT_VAL && value->tag != NULL_VAL) {
+            fprintf(stderr, "Only int or null object can be used in lit\n");
+            exit(1);
+        }
+        dst->ref = value;
+        // Tagged form of the literal for the superinstructions
+        dst->arg = value->tag == INT_VAL ? TAG_INT(((IntValue *)value)->value) : NULL_TAG;
+        break;
+    }
+
+    case PRINTF_OP: {
+        PrintfIns *ins = (PrintfIns *)src;
+        dst->ref = compile_format(poolString(machine, ins->format, "Print format"));
+        dst->arity = ins->arity;
+        break;
+    }
+
+    case OBJECT_OP: {
+        ObjectIns *ins = (ObjectIns *)src;
+        Value *class = vector_get(machine->program->values, ins->class);
+        if (class->tag != CLASS_VAL) {
+            fprintf(stderr, "Object instruction requires class value\n");
+            exit(1);
+        }
+        TClass *classTemplate = findClassByPoolIndex(machine, ins->class);
+        if (!classTemplate) {
+            fprintf(stderr, "Error: unknown object type\n");
+            exit(1);
+        }
+        dst->ref = classTemplate;
+        break;
+    }
+
+    case SLOT_OP:
+        dst->ref = poolString(machine, ((SlotIns *)src)->name, "Slot name");
+        dst->cache = newSlotCache();
+        break;
+
+    case SET_SLOT_OP:
+        dst->ref = poolString(machine, ((SetSlotIns *)src)->name, "Slot name");
+        dst->cache = newSlotCache();
+        break;
+
+    case CALL_SLOT_OP:
+    case TAIL_CALL_SLOT_OP:
+    case ADD_INT_OP:
+    case SUB_INT_OP:
+    case MUL_INT_OP:
+    case DIV_INT_OP:
+    case MOD_INT_OP:
+    case LT_INT_OP:
+    case GT_INT_OP:
+    case LE_INT_OP:
+    case GE_INT_OP:
+    case EQ_INT_OP:
+    case ARRAY_GET_OP:
+    case ARRAY_SET_OP:
+    case ARRAY_LEN_OP: {
+        CallSlotIns *ins = (CallSlotIns *)src;
+        dst->ref = poolString(machine, ins->name, "Method name");
+        dst->arg = selector_id(machine, (char *)dst->ref);
+        dst->arity = ins->arity;
+        dst->cache = calloc(1, sizeof(InlineCache));
+        break;
+    }
+
+    case CALL_OP:
+    case TAIL_CALL_OP: {
+        CallIns *ins = (CallIns *)src;
+        dst->ref = poolString(machine, ins->name, "Function name");
+        dst->arg = selector_id(machine, (char *)dst->ref);
+        dst->arity = ins->arity;
+        break;
+    }
+
+    case SET_LOCAL_OP:
+        dst->arg = ((SetLocalIns *)src)->idx;
+        break;
+
+    case GET_LOCAL_OP:
+        dst->arg = ((GetLocalIns *)src)->idx;
+        break;
+
+    case SET_GLOBAL_OP:
+        dst->arg = globalSlotIndex(machine, ((SetGlobalIns *)src)->name);
+        break;
+
+    case GET_GLOBAL_OP:
+        dst->arg = globalSlotIndex(machine, ((GetGlobalIns *)src)->name);
+        break;
+
+    case BRANCH_OP:
+        dst->arg = resolveLabel(machine, labels, ((BranchIns *)src)->name);
+        break;
+
+    case GOTO_OP:
+        dst->arg = resolveLabel(machine, labels, ((GotoIns *)src)->name);
+        break;
+
+    default:
+        fprintf(stderr, "Unknown instruction: %d\n", src->tag);
+        exit(1);
+    }
+
+    dst->handler = NULL;
+}
+
+/*
+ * Superinstructions
+ * The sequences below are the most frequent ones in the profile of the test
+ * programs (build with -DSEQUENCE_PROFILE). Only the first instruction of a
+ * sequence is rewritten, the others are left as they are, which keeps branch
+ * targets and return addresses valid and lets a fused handler fall back to
+ * the original instructions.
+ */
+typedef struct {
+    OpCode fused;
+    int length;
+    OpCode ops[4];
+} Superinstruction;
+
+// Longer sequences first, the first match wins
+static const Superinstruction superinstructions[] = {
+    {INC_LOCAL_OP, 4, {GET_LOCAL_OP, LIT_OP, ADD_INT_OP, SET_LOCAL_OP}},
+    {ADD_LOCAL_LIT_OP, 3, {GET_LOCAL_OP, LIT_OP, ADD_INT_OP}},
+    {GET_LOCAL_LIT_OP, 2, {GET_LOCAL_OP, LIT_OP}},
+    {GET_LOCAL_LOCAL_OP, 2, {GET_LOCAL_OP, GET_LOCAL_OP}},
+    {GET_GLOBAL_LOCAL_OP, 2, {GET_GLOBAL_OP, GET_LOCAL_OP}},
+    {SET_GET_LOCAL_OP, 2, {SET_LOCAL_OP, GET_LOCAL_OP}},
+    {BR_LT_OP, 2, {LT_INT_OP, BRANCH_OP}},
+    {BR_GT_OP, 2, {GT_INT_OP, BRANCH_OP}},
+    {BR_LE_OP, 2, {LE_INT_OP, BRANCH_OP}},
+    {BR_GE_OP, 2, {GE_INT_OP, BRANCH_OP}},
+    {BR_EQ_OP, 2, {EQ_INT_OP, BRANCH_OP}},
+};
+
+static int matchSuperinstruction(Instr *ins, int n, const Superinstruction *super) {
+    if (super->length > n) {
+        return 0;
+    }
+    for (int i = 0; i < super->length; i++) {
+        if (ins[i].op != super->ops[i]) {
+            return 0;
+        }
+    }
+    // The trace jit counts loops at their backward branch, which has to run
+    if (vm_options.trace_jit && ins[super->length - 1].op == BRANCH_OP && ins[super->length - 1].cache) {
+        return 0;
+    }
+    return 1;
+}
+
+static void fuseSuperinstructions(Instr *ins, int n) {
+    int count = sizeof(superinstructions) / sizeof(superinstructions[0]);
+    int i = 0;
+    while (i < n) {
+        int length = 1;
+        for (int k = 0; k < count; k++) {
+            if (matchSuperinstruction(&ins[i], n - i, &superinstructions[k])) {
+                ins[i].op = superinstructions[k].fused;
+                length = superinstructions[k].length;
+                break;
+            }
+        }
+        i += length;
+    }
+}
+
+OpCode base_opcode(OpCode op) {
+    switch (op) {
+    case GET_LOCAL_LIT_OP:
+    case GET_LOCAL_LOCAL_OP:
+    case ADD_LOCAL_LIT_OP:
+    case INC_LOCAL_OP:
+        return GET_LOCAL_OP;
+    case GET_GLOBAL_LOCAL_OP:
+        return GET_GLOBAL_OP;
+    case SET_GET_LOCAL_OP:
+        return SET_LOCAL_OP;
+    case BR_LT_OP:
+        return LT_INT_OP;
+    case BR_GT_OP:
+        return GT_INT_OP;
+    case BR_LE_OP:
+        return LE_INT_OP;
+    case BR_GE_OP:
+        return GE_INT_OP;
+    case BR_EQ_OP:
+        return EQ_INT_OP;
+    case PUSH_IMM_OP:
+        return LIT_OP;
+    case CALL_DIRECT_OP:
+        return CALL_OP;
+    case TAIL_CALL_DIRECT_OP:
+        return TAIL_CALL_OP;
+    default:
+        return op;
+    }
+}
+
+void link_method(Machine *machine, MethodValue *method) {
+    Instr *ins = (Instr *)malloc(sizeof(Instr) * vector_size(method->code));
+    if (!ins) {
+        fprintf(stderr, "Memory allocation failed for linked code\n");
+        exit(1);
+    }
+
+    int *lines = NULL;
+    if (method->lines) {
+        lines = (int *)malloc(sizeof(int) * (vector_size(method->code) + 1));
+    }
+
+    Map *labels = collectLabels(machine, method);
+    int n = 0;
+    for (int i = 0; i < vector_size(method->code); i++) {
+        ByteIns *src = vector_get(method->code, i);
+        // Branch targets are resolved, labels have nothing left to execute
+        if (src->tag == LABEL_OP) {
+            continue;
+        }
+        if (lines) {
+            lines[n] = method->lines[i];
+        }
+        linkInstr(machine, labels, src, &ins[n++]);
+    }
+    freeMap(labels);
+
+    // Backward branches close loops, the trace jit counts them
+    for (int i = 0; i < n; i++) {
+        if (ins[i].op == BRANCH_OP && ins[i].arg <= i) {
+            ins[i].cache = calloc(1, sizeof(LoopAnchor));
+        }
+    }
+
+#ifndef SEQUENCE_PROFILE
+    fuseSuperinstructions(ins, n);
+#endif
+
+    method->ins = ins;
+    method->ins_lines = lines;
+    method->ninstr = n;
+}
+
+void link_program(Machine *machine) {
+    Vector *values = machine->program->values;
+    for (int i = 0; i < vector_size(values); i++) {
+        Value *value = vector_get(values, i);
+        if (value->tag == METHOD_VAL) {
+            link_method(machine, (MethodValue *)value);
+        }
+    }
+}
+
+void link_handlers(Machine *machine, void **handlers) {
+    Vector *values = machine->program->values;
+    for (int i = 0; i < vector_size(values); i++) {
+        Value *value = vector_get(values, i);
+        if (value->tag != METHOD_VAL) {
+            continue;
+        }
+        MethodValue *method = (MethodValue *)value;
+        for (int j = 0; j < method->ninstr; j++) {
+            method->ins[j].handler = handlers[method->ins[j].op];
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#include "feeny/output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *buffer = NULL;
+static int unbuffered = 0;
+
+PrintFormat *compile_format(const char *format) {
+    PrintFormat *compiled = (PrintFormat *)malloc(sizeof(PrintFormat));
+    int holes = 0;
+    for (const char *c = format; *c; c++) {
+        if (*c == '~') {
+            holes++;
+        }
+    }
+    compiled->nholes = holes;
+    compiled->chunks = (char **)malloc(sizeof(char *) * (holes + 1));
+    compiled->lengths = (int *)malloc(sizeof(int) * (holes + 1));
+
+    const char *start = format;
+    for (int i = 0; i <= holes; i++) {
+        const char *end = strchr(start, i < holes ? '~' : '\0');
+        compiled->lengths[i] = (int)(end - start);
+        compiled->chunks[i] = (char *)start;
+        start = end + 1;
+    }
+    return compiled;
+}
+
+void init_output(size_t size) {
+    if (size == 0) {
+        unbuffered = 1;
+        return;
+    }
+    buffer = (char *)malloc(size);
+    if (!buffer || setvbuf(stdout, buffer, _IOFBF, size) != 0) {
+        fprintf(stderr, "Memory allocation failed for output buffer\n");
+        exit(1);
+    }
+}
+
+// Digits of value, written backwards from the end of buf
+static char *formatLong(char *end, long value) {
+    unsigned long magnitude = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+    char *p = end;
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        *--p = '-';
+    }
+    return p;
+}
+
+void output_format(PrintFormat *format, const long *args) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+
+    flockfile(stdout);
+    fwrite(format->chunks[0], 1, format->lengths[0], stdout);
+    for (int i = 0; i < format->nholes; i++) {
+        char *start = formatLong(end, args[i]);
+        fwrite(start, 1, end - start, stdout);
+        fwrite(format->chunks[i + 1], 1, format->lengths[i + 1], stdout);
+    }
+    if (unbuffered) {
+        fflush(stdout);
+    }
+    funlockfile(stdout);
+}
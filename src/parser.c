@@ -539,16 +539,19 @@ static ScopeStmt *parse_scope_statement(Parser *parser) {
         if (check(parser, TOKEN_EOF) || check(parser, TOKEN_DEDENT)) {
             break;
         }
+        int line = parser->current->line;
         switch (parser->current->type) {
         case TOKEN_VAR: {
             ScopeStmt *stmt = parse_var_declaration(parser);
             stmt->tag = VAR_STMT;
+            stmt->line = line;
             vector_add(stmts, stmt);
             break;
         }
         case TOKEN_DEFN: {
             ScopeStmt *stmt = parse_function_declaration(parser);
             stmt->tag = FN_STMT;
+            stmt->line = line;
             vector_add(stmts, stmt);
             break;
         }
@@ -559,6 +562,7 @@ static ScopeStmt *parse_scope_statement(Parser *parser) {
         default: {
             Exp *expr = parse_expression(parser);
             ScopeStmt *stmt = make_ScopeExp(expr);
+            stmt->line = line;
             vector_add(stmts, stmt);
             break;
         }
@@ -36,27 +36,24 @@ RNull newNullObj() {
 }
 
 RArray *newArrayObj(int length, RTObj *initValue) {
+    // The collection halloc may run moves a heap init value, so it stays on
+    // the operand stack as a root while the array is allocated
+    *machine->stack.top++ = (intptr_t)initValue;
     RArray *rv = (RArray *)halloc(sizeof(RArray) + length * sizeof(intptr_t));
-    rv->type = ARRAY_TYPE;
+    intptr_t init = *--machine->stack.top;
+    rv->header = MAKE_HEADER(ARRAY_TYPE, 1, length);
     rv->length = length;
     for (int i = 0; i < length; i++) {
-        if (IS_PTR((intptr_t)initValue)) {
-            if (!is_forward((intptr_t)initValue)) {
-                rv->slots[i] = (intptr_t)initValue;
-            } else {
-                rv->slots[i] = (intptr_t)get_forward_address(UNTAG_PTR((intptr_t)initValue));
-            }
-        } else {
-            rv->slots[i] = (intptr_t)initValue;
-        }
+        rv->slots[i] = init;
     }
+    write_barrier(rv, init); // Large arrays are allocated tenured
     return (void *)TAG_PTR((intptr_t)rv);
     // return rv;
 }
 
 RClass *newClassObj(ObjType type, int slotNum) {
     RClass *rv = (RClass *)halloc(sizeof(RClass) + slotNum * sizeof(intptr_t));
-    rv->type = type;
+    rv->header = MAKE_HEADER(type, 0, slotNum + 1); // Parent and vars
     rv->parent = NULL_TAG;
     for (int i = 0; i < slotNum; i++) {
         rv->var_slots[i] = 0;
@@ -71,5 +68,6 @@ TClass *newTemplateClass(ObjType type, int index) {
     rv->poolIndex = index;
     rv->varNames = make_vector();
     rv->funcNameToPoolIndex = newMap();
+    rv->methods = NULL;
     return rv;
 }
\ No newline at end of file
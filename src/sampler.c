@@ -0,0 +1,147 @@
+#include "feeny/sampler.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Distinct folded stacks and how often they were sampled
+typedef struct Stack Stack;
+struct Stack {
+    char *folded;
+    long count;
+    Stack *next;
+};
+
+#define SAMPLE_BUCKETS 1024
+
+static Stack *stacks[SAMPLE_BUCKETS];
+static long samples = 0;
+volatile sig_atomic_t sample_pending = 0;
+
+static void onTick(int sig) {
+    (void)sig;
+    sample_pending = 1;
+}
+
+static void setTimer(int interval) {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        fprintf(stderr, "Error: cannot start the sampling timer\n");
+        exit(1);
+    }
+}
+
+void start_sampler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onTick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        fprintf(stderr, "Error: cannot install the sampling signal handler\n");
+        exit(1);
+    }
+    setTimer(vm_options.sample_interval);
+}
+
+static const char *methodName(Machine *machine, MethodValue *method) {
+    Vector *values = machine->program->values;
+    if (method == vector_get(values, machine->program->entry)) {
+        return "<entry>";
+    }
+    Value *name = vector_get(values, method->name);
+    return name->tag == STRING_VAL ? ((StringValue *)name)->value : "?";
+}
+
+// Append "name:line" of a frame running method at ip
+static void appendFrame(Machine *machine, char **buf, size_t *len, size_t *cap, MethodValue *method, int ip) {
+    const char *name = methodName(machine, method);
+    size_t need = *len + strlen(name) + 16;
+    if (need > *cap) {
+        *cap = 2 * need;
+        *buf = (char *)realloc(*buf, *cap);
+    }
+    if (*len > 0) {
+        (*buf)[(*len)++] = ';';
+    }
+    int line = method->ins_lines && ip >= 0 && ip < method->ninstr ? method->ins_lines[ip] : 0;
+    if (line > 0) {
+        *len += sprintf(*buf + *len, "%s:%d", name, line);
+    } else {
+        *len += sprintf(*buf + *len, "%s", name);
+    }
+}
+
+static void addStack(char *folded) {
+    unsigned long hash = 5381;
+    for (char *c = folded; *c; c++) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    Stack **bucket = &stacks[hash % SAMPLE_BUCKETS];
+    for (Stack *s = *bucket; s; s = s->next) {
+        if (strcmp(s->folded, folded) == 0) {
+            s->count++;
+            free(folded);
+            return;
+        }
+    }
+    Stack *s = (Stack *)malloc(sizeof(Stack));
+    s->folded = folded;
+    s->count = 1;
+    s->next = *bucket;
+    *bucket = s;
+}
+
+void take_sample(Machine *machine, int ip) {
+    // Frames from the top, each caller is at the call before its callee's
+    // return address
+    Frame *frames[MAX_SAMPLE_DEPTH];
+    int ips[MAX_SAMPLE_DEPTH];
+    int depth = 0;
+    Frame *frame = machine->cur;
+    while (frame && depth < MAX_SAMPLE_DEPTH) {
+        frames[depth] = frame;
+        ips[depth] = ip;
+        ip = (int)frame->ra - 1;
+        frame = frame->parent;
+        depth++;
+    }
+
+    size_t len = 0;
+    size_t cap = 256;
+    char *folded = (char *)malloc(cap);
+    if (frame) {
+        // Deeper stacks keep their top frames
+        len = sprintf(folded, "...");
+    }
+    for (int i = depth - 1; i >= 0; i--) {
+        appendFrame(machine, &folded, &len, &cap, frames[i]->method, ips[i]);
+    }
+    folded[len] = '\0';
+    addStack(folded);
+    samples++;
+    sample_pending = 0;
+}
+
+void stop_sampler(Machine *machine) {
+    (void)machine;
+    setTimer(0);
+    signal(SIGPROF, SIG_IGN);
+
+    FILE *out = fopen(vm_options.sample_file, "w");
+    if (!out) {
+        fprintf(stderr, "Error: cannot write samples to %s\n", vm_options.sample_file);
+        exit(1);
+    }
+    for (int i = 0; i < SAMPLE_BUCKETS; i++) {
+        for (Stack *s = stacks[i]; s; s = s->next) {
+            fprintf(out, "%s %ld\n", s->folded, s->count);
+        }
+    }
+    fclose(out);
+    fprintf(stderr, "Wrote %ld samples to %s\n", samples, vm_options.sample_file);
+}
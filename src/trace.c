@@ -0,0 +1,779 @@
+#include "feeny/trace.h"
+#include "feeny/jit.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include "feeny/x86.h"
+
+// Recorded instruction of a trace
+typedef struct {
+    OpCode op;    // Base opcode, superinstructions are recorded one by one
+    int ip;       // Index in the method's linked code, where guards exit to
+    intptr_t arg; // Local or global index, tagged literal or branch target
+    int taken;    // Direction a branch took while recording
+} TraceIns;
+
+struct Trace {
+    void *code;       // Native code, returns the index of the exit it took
+    size_t size;      // Size of the mapping
+    MethodValue *method;
+    int head;         // ip of the loop body the trace starts at and loops back to
+    int length;       // Recorded instructions
+    int nexits;
+    int *exitIps;     // ip every exit resumes the interpreter at
+    long *exitCounts; // How often every exit was taken
+    long entries;
+    Trace *next;      // All compiled traces, for the statistics
+};
+
+static Trace *traces = NULL;
+static long traces_recorded = 0;
+static long traces_aborted = 0;
+static long loops_blacklisted = 0;
+static long trace_entries = 0;
+
+#define IS_ARRAY(v) (IS_PTR(v) && OBJ_TYPE(UNTAG_PTR(v)) == ARRAY_TYPE)
+
+//============================================================
+//======================== RECORDER ==========================
+//============================================================
+
+/*
+ * Execute one iteration of the loop closed by the branch `anchor`, starting
+ * at its target, and log every instruction into `out`. Recording stops before
+ * an instruction the trace compiler does not handle (calls, allocation,
+ * printf) or one that would not take its fast path; that instruction is left
+ * to the interpreter. Either way the machine is left where recording stopped.
+ * Returns the trace length, or 0 when the iteration could not be recorded.
+ */
+static int recordTrace(Machine *machine, Instr *anchor, TraceIns *out) {
+    Instr *code = machine->cur->method->ins;
+    intptr_t *locals = machine->cur->locals;
+    intptr_t *base = machine->stack.top;
+    intptr_t *sp = base;
+    int ip = (int)anchor->arg;
+    int n = 0;
+    int closed = 0;
+
+    while (!closed && n < MAX_TRACE_LENGTH) {
+        Instr *ins = &code[ip];
+        TraceIns *t = &out[n];
+        t->op = base_opcode(ins->op);
+        t->ip = ip;
+        t->arg = ins->arg;
+        t->taken = 0;
+
+        switch (t->op) {
+        case LIT_OP:
+            *sp++ = ins->arg;
+            ip++;
+            break;
+        case GET_LOCAL_OP:
+            *sp++ = locals[ins->arg];
+            ip++;
+            break;
+        case SET_LOCAL_OP:
+            locals[ins->arg] = *--sp;
+            ip++;
+            break;
+        case GET_GLOBAL_OP:
+            *sp++ = machine->global->var_slots[ins->arg];
+            ip++;
+            break;
+        case SET_GLOBAL_OP:
+            machine->global->var_slots[ins->arg] = *--sp;
+            ip++;
+            break;
+        case DROP_OP:
+            sp--;
+            ip++;
+            break;
+        case GOTO_OP:
+            ip = (int)ins->arg;
+            break;
+        case BRANCH_OP:
+            t->taken = !IS_NULL(*--sp);
+            ip = t->taken ? (int)ins->arg : ip + 1;
+            if (ins == anchor) {
+                // Back at the loop head closes the trace, leaving the loop aborts it
+                if (!t->taken) {
+                    goto abort;
+                }
+                closed = 1;
+            }
+            break;
+        case ADD_INT_OP:
+        case SUB_INT_OP:
+        case MUL_INT_OP:
+        case DIV_INT_OP:
+        case MOD_INT_OP:
+        case LT_INT_OP:
+        case GT_INT_OP:
+        case LE_INT_OP:
+        case GE_INT_OP:
+        case EQ_INT_OP: {
+            intptr_t x = sp[-2];
+            intptr_t y = sp[-1];
+            if (!IS_INT(x) || !IS_INT(y)) {
+                goto abort;
+            }
+            intptr_t r;
+            switch (t->op) {
+            case ADD_INT_OP:
+                r = x + y;
+                break;
+            case SUB_INT_OP:
+                r = x - y;
+                break;
+            case MUL_INT_OP:
+                r = x * UNTAG_INT(y);
+                break;
+            case DIV_INT_OP:
+                r = TAG_INT(UNTAG_INT(x) / UNTAG_INT(y));
+                break;
+            case MOD_INT_OP:
+                r = TAG_INT(UNTAG_INT(x) % UNTAG_INT(y));
+                break;
+            case LT_INT_OP:
+                r = x < y ? TAG_INT(0) : NULL_TAG;
+                break;
+            case GT_INT_OP:
+                r = x > y ? TAG_INT(0) : NULL_TAG;
+                break;
+            case LE_INT_OP:
+                r = x <= y ? TAG_INT(0) : NULL_TAG;
+                break;
+            case GE_INT_OP:
+                r = x >= y ? TAG_INT(0) : NULL_TAG;
+                break;
+            default:
+                r = x == y ? TAG_INT(0) : NULL_TAG;
+                break;
+            }
+            sp--;
+            sp[-1] = r;
+            ip++;
+            break;
+        }
+        case ARRAY_GET_OP: {
+            if (!IS_ARRAY(sp[-2]) || !IS_INT(sp[-1])) {
+                goto abort;
+            }
+            RArray *arr = (RArray *)UNTAG_PTR(sp[-2]);
+            intptr_t index = UNTAG_INT(sp[-1]);
+            if (index < 0 || (size_t)index >= arr->length) {
+                goto abort;
+            }
+            sp--;
+            sp[-1] = arr->slots[index];
+            ip++;
+            break;
+        }
+        case ARRAY_SET_OP: {
+            if (!IS_ARRAY(sp[-3]) || !IS_INT(sp[-2])) {
+                goto abort;
+            }
+            RArray *arr = (RArray *)UNTAG_PTR(sp[-3]);
+            intptr_t index = UNTAG_INT(sp[-2]);
+            if (index < 0 || (size_t)index >= arr->length) {
+                goto abort;
+            }
+            arr->slots[index] = sp[-1];
+            write_barrier(arr, sp[-1]);
+            sp -= 2;
+            sp[-1] = NULL_TAG;
+            ip++;
+            break;
+        }
+        case ARRAY_LEN_OP:
+            if (!IS_ARRAY(sp[-1])) {
+                goto abort;
+            }
+            sp[-1] = TAG_INT((intptr_t)((RArray *)UNTAG_PTR(sp[-1]))->length);
+            ip++;
+            break;
+        default:
+            goto abort;
+        }
+        n++;
+        // The body works on its own operands only
+        if (sp < base) {
+            goto abort;
+        }
+    }
+    if (!closed || sp != base) {
+        goto abort;
+    }
+
+    machine->stack.top = sp;
+    machine->ip = ip;
+    return n;
+
+abort:
+    machine->stack.top = sp;
+    machine->ip = ip;
+    return 0;
+}
+
+//============================================================
+//======================== COMPILER ==========================
+//============================================================
+
+/*
+ * Register usage of a trace
+ *   rbx: operand stack top at the loop head, operands live at fixed offsets
+ *   r12: locals of the current frame
+ *   r13: global slots, traces do not allocate so the global object stays put
+ *   r14: machine
+ */
+
+// Where an operand of the abstract stack currently is
+typedef enum {
+    VAL_MEM,   // In its operand stack slot
+    VAL_CONST, // A tagged constant, not yet written to its slot
+    VAL_LOCAL, // The current value of a local, not yet copied to its slot
+    VAL_COND   // Flags of a comparison, consumed by the branch that follows
+} ValKind;
+
+typedef struct {
+    ValKind kind;
+    intptr_t value; // Constant, local index or condition code
+    int isInt;      // Known to be an int, so no guard is needed
+} AbsVal;
+
+#define MAX_TRACE_DEPTH 64
+
+// A guard's jump to its exit stub, with the operand stack to write back
+typedef struct {
+    size_t pos;
+    int ip;
+    int depth;
+    AbsVal *stack;
+} TraceExit;
+
+typedef struct {
+    Asm a;
+    AbsVal stack[MAX_TRACE_DEPTH];
+    int depth;
+    char *localInt; // Locals known to hold an int in this iteration
+    int nlocals;
+    TraceExit *exits;
+    int nexits;
+    int capExits;
+} TraceCompiler;
+
+#define SLOT(k) ((int32_t)(sizeof(intptr_t) * (k)))
+#define GLOBAL_SLOT(g) ((int32_t)(sizeof(intptr_t) * (g)))
+
+static void loadVal(TraceCompiler *c, int reg, AbsVal *v, int k) {
+    switch (v->kind) {
+    case VAL_CONST:
+        emitMovImm(&c->a, reg, v->value);
+        break;
+    case VAL_LOCAL:
+        emitLoad(&c->a, reg, R12, SLOT(v->value));
+        break;
+    default:
+        emitLoad(&c->a, reg, RBX, SLOT(k));
+        break;
+    }
+}
+
+static void materialize(TraceCompiler *c, int k) {
+    AbsVal *v = &c->stack[k];
+    if (v->kind != VAL_MEM) {
+        loadVal(c, RAX, v, k);
+        emitStore(&c->a, RBX, SLOT(k), RAX);
+        v->kind = VAL_MEM;
+    }
+}
+
+// Jump to a new exit stub when cc holds, resuming the interpreter at ip with
+// the current abstract stack
+static void guard(TraceCompiler *c, int cc, int ip) {
+    if (c->nexits == c->capExits) {
+        c->capExits = 2 * c->capExits + 8;
+        c->exits = (TraceExit *)realloc(c->exits, sizeof(TraceExit) * c->capExits);
+    }
+    TraceExit *e = &c->exits[c->nexits++];
+    e->pos = emitJump(&c->a, cc);
+    e->ip = ip;
+    e->depth = c->depth;
+    e->stack = (AbsVal *)malloc(sizeof(AbsVal) * (c->depth + 1));
+    memcpy(e->stack, c->stack, sizeof(AbsVal) * c->depth);
+}
+
+// test reg8, TAG_MASK for rax, rcx or rdx
+static void emitTestTag(Asm *a, int reg) {
+    emitByte(a, 0xF6);
+    emitByte(a, 0xC0 | reg);
+    emitByte(a, TAG_MASK);
+}
+
+static void guardInt(TraceCompiler *c, int k, int ip) {
+    AbsVal *v = &c->stack[k];
+    if (v->isInt) {
+        return;
+    }
+    loadVal(c, RAX, v, k);
+    emitTestTag(&c->a, RAX);
+    guard(c, CC_NE, ip);
+    v->isInt = 1;
+    if (v->kind == VAL_LOCAL) {
+        c->localInt[v->value] = 1;
+    }
+}
+
+// rcx = untagged array of operand k
+static void guardArray(TraceCompiler *c, int k, int ip) {
+    Asm *a = &c->a;
+    loadVal(c, RCX, &c->stack[k], k);
+    emitRegReg(a, 0x89, RCX, RDX);
+    emitByte(a, 0x83);
+    emitByte(a, 0xE2);
+    emitByte(a, TAG_MASK); // and edx, TAG_MASK
+    emitByte(a, 0x83);
+    emitByte(a, 0xFA);
+    emitByte(a, HEAP_TAG); // cmp edx, HEAP_TAG
+    guard(c, CC_NE, ip);
+    emitAluImm8(a, 5, RCX, HEAP_TAG);
+    emitByte(a, 0x66);
+    emitByte(a, 0x83);
+    emitByte(a, 0x39);
+    emitByte(a, ARRAY_TYPE); // cmp word [rcx], ARRAY_TYPE, the header's type
+    guard(c, CC_NE, ip);
+}
+
+// rcx = untagged array of operand k, rdx = untagged index of operand k + 1
+static void guardArrayIndex(TraceCompiler *c, int k, int ip) {
+    Asm *a = &c->a;
+    guardArray(c, k, ip);
+    AbsVal *index = &c->stack[k + 1];
+    loadVal(c, RDX, index, k + 1);
+    if (!index->isInt) {
+        emitTestTag(a, RDX);
+        guard(c, CC_NE, ip);
+    }
+    emitShift(a, 7, RDX, TAG_BITS);
+    emitMem(a, 0x3B, RDX, RCX, (int32_t)offsetof(RArray, length)); // cmp rdx, [rcx + length]
+    guard(c, CC_AE, ip);
+}
+
+// Write barrier of the store of rax into the array in rcx, heap values
+// call into the collector
+static void emitWriteBarrier(TraceCompiler *c, AbsVal *value) {
+    Asm *a = &c->a;
+    if (value->isInt || (value->kind == VAL_CONST && !IS_PTR(value->value))) {
+        return; // Known not to be a heap value
+    }
+    emitRegReg(a, 0x89, RAX, RDX);
+    emitByte(a, 0x83);
+    emitByte(a, 0xE2);
+    emitByte(a, TAG_MASK); // and edx, TAG_MASK
+    emitByte(a, 0x83);
+    emitByte(a, 0xFA);
+    emitByte(a, HEAP_TAG); // cmp edx, HEAP_TAG
+    size_t skip = emitJump(a, CC_NE);
+    emitRegReg(a, 0x89, RCX, RDI);
+    emitRegReg(a, 0x89, RAX, RSI);
+    emitCall(a, write_barrier_call);
+    patchJump(a, skip, a->len);
+}
+
+static void push(TraceCompiler *c, ValKind kind, intptr_t value, int isInt) {
+    AbsVal *v = &c->stack[c->depth++];
+    v->kind = kind;
+    v->value = value;
+    v->isInt = isInt;
+}
+
+static int fitsInt32(intptr_t v) {
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+static int conditionCode(OpCode op) {
+    switch (op) {
+    case LT_INT_OP:
+        return CC_L;
+    case GT_INT_OP:
+        return CC_G;
+    case LE_INT_OP:
+        return CC_LE;
+    case GE_INT_OP:
+        return CC_GE;
+    default:
+        return CC_E;
+    }
+}
+
+static void compileIntOp(TraceCompiler *c, TraceIns *t, TraceIns *next) {
+    Asm *a = &c->a;
+    int k = c->depth - 2;
+    guardInt(c, k, t->ip);
+    guardInt(c, k + 1, t->ip);
+    AbsVal *y = &c->stack[k + 1];
+    // add, sub and the comparisons take a constant right operand as imm32
+    int immediate = y->kind == VAL_CONST && fitsInt32(y->value) && t->op != MUL_INT_OP &&
+                    t->op != DIV_INT_OP && t->op != MOD_INT_OP;
+    loadVal(c, RAX, &c->stack[k], k);
+    if (!immediate) {
+        loadVal(c, RCX, y, k + 1);
+    }
+
+    switch (t->op) {
+    case ADD_INT_OP:
+        if (immediate) {
+            emitAluImm32(a, 0, RAX, (int32_t)y->value);
+        } else {
+            emitRegReg(a, 0x01, RCX, RAX);
+        }
+        break;
+    case SUB_INT_OP:
+        if (immediate) {
+            emitAluImm32(a, 5, RAX, (int32_t)y->value);
+        } else {
+            emitRegReg(a, 0x29, RCX, RAX);
+        }
+        break;
+    case MUL_INT_OP:
+        emitShift(a, 7, RCX, TAG_BITS);
+        emitOp0F(a, 0xAF, RAX, RCX);
+        break;
+    case DIV_INT_OP:
+    case MOD_INT_OP:
+        emitShift(a, 7, RAX, TAG_BITS);
+        emitShift(a, 7, RCX, TAG_BITS);
+        emitByte(a, 0x48);
+        emitByte(a, 0x99); // cqo
+        emitRex(a, 0, RCX);
+        emitByte(a, 0xF7);
+        emitByte(a, 0xF9); // idiv rcx
+        if (t->op == MOD_INT_OP) {
+            emitRegReg(a, 0x89, RDX, RAX);
+        }
+        emitShift(a, 4, RAX, TAG_BITS);
+        break;
+    default: {
+        if (immediate) {
+            emitAluImm32(a, 7, RAX, (int32_t)y->value);
+        } else {
+            emitRegReg(a, 0x39, RCX, RAX); // cmp rax, rcx
+        }
+        c->depth -= 2;
+        int cc = conditionCode(t->op);
+        if (next && next->op == BRANCH_OP) {
+            // The branch guards on the flags directly
+            push(c, VAL_COND, cc, 0);
+            return;
+        }
+        // Comparisons yield int 0 for true and null for false
+        emitByte(a, 0xB8 + RAX);
+        emitInt32(a, NULL_TAG); // mov eax, NULL_TAG
+        emitByte(a, 0xB8 + RDX);
+        emitInt32(a, 0); // mov edx, 0
+        emitOp0F(a, 0x40 + cc, RAX, RDX);
+        emitStore(a, RBX, SLOT(k), RAX);
+        push(c, VAL_MEM, 0, 0);
+        return;
+    }
+    }
+    emitStore(a, RBX, SLOT(k), RAX);
+    c->depth -= 2;
+    push(c, VAL_MEM, 0, 1);
+}
+
+// Returns 0 when the trace cannot be compiled
+static int compileTraceIns(TraceCompiler *c, TraceIns *t, TraceIns *next) {
+    Asm *a = &c->a;
+    switch (t->op) {
+    case LIT_OP:
+        push(c, VAL_CONST, t->arg, IS_INT(t->arg));
+        break;
+
+    case GET_LOCAL_OP:
+        push(c, VAL_LOCAL, t->arg, c->localInt[t->arg]);
+        break;
+
+    case SET_LOCAL_OP: {
+        AbsVal v = c->stack[--c->depth];
+        // Operands still reading the old value get their own copy first
+        for (int k = 0; k < c->depth; k++) {
+            if (c->stack[k].kind == VAL_LOCAL && c->stack[k].value == t->arg) {
+                materialize(c, k);
+            }
+        }
+        if (v.kind != VAL_LOCAL || v.value != t->arg) {
+            loadVal(c, RAX, &v, c->depth);
+            emitStore(a, R12, SLOT(t->arg), RAX);
+        }
+        c->localInt[t->arg] = v.isInt;
+        break;
+    }
+
+    case GET_GLOBAL_OP:
+        emitLoad(a, RAX, R13, GLOBAL_SLOT(t->arg));
+        emitStore(a, RBX, SLOT(c->depth), RAX);
+        push(c, VAL_MEM, 0, 0);
+        break;
+
+    case SET_GLOBAL_OP: {
+        c->depth--;
+        loadVal(c, RAX, &c->stack[c->depth], c->depth);
+        emitStore(a, R13, GLOBAL_SLOT(t->arg), RAX);
+        break;
+    }
+
+    case DROP_OP:
+        c->depth--;
+        break;
+
+    case GOTO_OP:
+        break;
+
+    case BRANCH_OP: {
+        AbsVal v = c->stack[--c->depth];
+        // Leave the trace where the branch goes the other way
+        int exitIp = t->taken ? t->ip + 1 : (int)t->arg;
+        if (v.kind == VAL_COND) {
+            guard(c, t->taken ? (int)v.value ^ 1 : (int)v.value, exitIp);
+        } else if (v.kind == VAL_CONST) {
+            // Always goes the recorded way
+        } else {
+            loadVal(c, RAX, &v, c->depth);
+            emitByte(a, 0x48);
+            emitByte(a, 0x83);
+            emitByte(a, 0xF8);
+            emitByte(a, NULL_TAG); // cmp rax, NULL_TAG
+            guard(c, t->taken ? CC_E : CC_NE, exitIp);
+        }
+        break;
+    }
+
+    case ADD_INT_OP:
+    case SUB_INT_OP:
+    case MUL_INT_OP:
+    case DIV_INT_OP:
+    case MOD_INT_OP:
+    case LT_INT_OP:
+    case GT_INT_OP:
+    case LE_INT_OP:
+    case GE_INT_OP:
+    case EQ_INT_OP:
+        compileIntOp(c, t, next);
+        break;
+
+    case ARRAY_GET_OP: {
+        int k = c->depth - 2;
+        guardArrayIndex(c, k, t->ip);
+        emitByte(a, 0x48);
+        emitByte(a, 0x8B);
+        emitByte(a, 0x44);
+        emitByte(a, 0xD1);
+        emitByte(a, offsetof(RArray, slots)); // mov rax, [rcx + rdx * 8 + slots]
+        emitStore(a, RBX, SLOT(k), RAX);
+        c->depth = k;
+        push(c, VAL_MEM, 0, 0);
+        break;
+    }
+
+    case ARRAY_SET_OP: {
+        int k = c->depth - 3;
+        guardArrayIndex(c, k, t->ip);
+        loadVal(c, RAX, &c->stack[k + 2], k + 2);
+        emitByte(a, 0x48);
+        emitByte(a, 0x89);
+        emitByte(a, 0x44);
+        emitByte(a, 0xD1);
+        emitByte(a, offsetof(RArray, slots)); // mov [rcx + rdx * 8 + slots], rax
+        emitWriteBarrier(c, &c->stack[k + 2]);
+        c->depth = k;
+        push(c, VAL_CONST, NULL_TAG, 0);
+        break;
+    }
+
+    case ARRAY_LEN_OP: {
+        int k = c->depth - 1;
+        guardArray(c, k, t->ip);
+        emitLoad(a, RAX, RCX, (int32_t)offsetof(RArray, length));
+        emitShift(a, 4, RAX, TAG_BITS);
+        emitStore(a, RBX, SLOT(k), RAX);
+        c->depth = k;
+        push(c, VAL_MEM, 0, 1);
+        break;
+    }
+
+    default:
+        return 0;
+    }
+    return c->depth >= 0 && c->depth < MAX_TRACE_DEPTH;
+}
+
+/*
+ * Trace layout
+ *   prologue: saves registers, loads rbx/r12/r13/r14
+ *   loop:     the recorded instructions, then a jump back to loop
+ *   exits:    one stub per guard, writing the operands of its abstract stack
+ *             back, then storing the stack top and ip for the interpreter
+ */
+static Trace *compileTrace(Machine *machine, TraceIns *ins, int n) {
+    MethodValue *method = machine->cur->method;
+    TraceCompiler c;
+    initAsm(&c.a, 256 + 32 * (size_t)n);
+    c.depth = 0;
+    c.nlocals = method->nargs + method->nlocals;
+    c.localInt = (char *)calloc(c.nlocals + 1, 1);
+    c.exits = NULL;
+    c.nexits = 0;
+    c.capExits = 0;
+
+    Asm *a = &c.a;
+    emitByte(a, 0x53); // push rbx
+    emitByte(a, 0x41);
+    emitByte(a, 0x54); // push r12
+    emitByte(a, 0x41);
+    emitByte(a, 0x55); // push r13
+    emitByte(a, 0x41);
+    emitByte(a, 0x56); // push r14
+    emitByte(a, 0x41);
+    emitByte(a, 0x57); // push r15, keeps the stack 16-byte aligned
+    emitMovImm(a, R14, (int64_t)(intptr_t)machine);
+    emitLoad(a, RBX, R14, MACHINE_OFFSET(stack.top));
+    emitLoad(a, R12, R14, MACHINE_OFFSET(cur));
+    emitAluImm8(a, 0, R12, (int8_t)offsetof(Frame, locals));
+    emitLoad(a, R13, R14, MACHINE_OFFSET(global));
+    emitAluImm8(a, 0, R13, (int8_t)offsetof(RClass, var_slots));
+
+    size_t loop = a->len;
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++) {
+        ok = compileTraceIns(&c, &ins[i], i + 1 < n ? &ins[i + 1] : NULL);
+    }
+    patchJump(a, emitJump(a, -1), loop);
+
+    size_t epilogue = a->len;
+    emitByte(a, 0x41);
+    emitByte(a, 0x5F); // pop r15
+    emitByte(a, 0x41);
+    emitByte(a, 0x5E); // pop r14
+    emitByte(a, 0x41);
+    emitByte(a, 0x5D); // pop r13
+    emitByte(a, 0x41);
+    emitByte(a, 0x5C); // pop r12
+    emitByte(a, 0x5B); // pop rbx
+    emitByte(a, 0xC3); // ret
+
+    for (int i = 0; i < c.nexits && ok; i++) {
+        TraceExit *e = &c.exits[i];
+        patchJump(a, e->pos, a->len);
+        for (int k = 0; k < e->depth; k++) {
+            if (e->stack[k].kind != VAL_MEM) {
+                loadVal(&c, RAX, &e->stack[k], k);
+                emitStore(a, RBX, SLOT(k), RAX);
+            }
+        }
+        emitMem(a, 0x8D, RAX, RBX, SLOT(e->depth)); // lea rax, [rbx + depth]
+        emitStore(a, R14, MACHINE_OFFSET(stack.top), RAX);
+        emitMovImm(a, RAX, e->ip);
+        emitStore(a, R14, MACHINE_OFFSET(ip), RAX);
+        emitByte(a, 0xB8 + RAX);
+        emitInt32(a, i); // mov eax, exit
+        patchJump(a, emitJump(a, -1), epilogue);
+    }
+
+    Trace *trace = NULL;
+    if (ok) {
+        trace = (Trace *)calloc(1, sizeof(Trace));
+        trace->code = finishAsm(a, &trace->size);
+        trace->method = method;
+        trace->head = ins[0].ip;
+        trace->length = n;
+        trace->nexits = c.nexits;
+        trace->exitIps = (int *)malloc(sizeof(int) * (c.nexits + 1));
+        trace->exitCounts = (long *)calloc(c.nexits + 1, sizeof(long));
+        for (int i = 0; i < c.nexits; i++) {
+            trace->exitIps[i] = c.exits[i].ip;
+        }
+    } else {
+        free(a->buf);
+    }
+
+    for (int i = 0; i < c.nexits; i++) {
+        free(c.exits[i].stack);
+    }
+    free(c.exits);
+    free(c.localInt);
+    return trace;
+}
+
+//============================================================
+//======================== LOOP EDGES ========================
+//============================================================
+
+typedef int (*TraceEntry)(void);
+
+int trace_loop_edge(Machine *machine, Instr *branch) {
+    LoopAnchor *anchor = (LoopAnchor *)branch->cache;
+    if (anchor->trace) {
+        Trace *trace = anchor->trace;
+        trace->entries++;
+        trace_entries++;
+        int exit = ((TraceEntry)trace->code)();
+        trace->exitCounts[exit]++;
+        return 1;
+    }
+    if (anchor->aborts >= MAX_TRACE_ABORTS || ++anchor->count < HOT_LOOP_THRESHOLD) {
+        return 0;
+    }
+
+    // Hot loop: record the next iteration, which also executes it
+    anchor->count = 0;
+    TraceIns *ins = (TraceIns *)malloc(sizeof(TraceIns) * MAX_TRACE_LENGTH);
+    int n = recordTrace(machine, branch, ins);
+    Trace *trace = n > 0 ? compileTrace(machine, ins, n) : NULL;
+    free(ins);
+
+    if (trace) {
+        traces_recorded++;
+        anchor->trace = trace;
+        trace->next = traces;
+        traces = trace;
+    } else {
+        traces_aborted++;
+        if (++anchor->aborts == MAX_TRACE_ABORTS) {
+            loops_blacklisted++;
+        }
+    }
+    return 1;
+}
+
+void print_trace_stats(Machine *machine) {
+    fprintf(stderr, "Trace statistics:\n");
+    fprintf(stderr, "  traces compiled: %ld, recordings aborted: %ld, loops blacklisted: %ld\n",
+            traces_recorded, traces_aborted, loops_blacklisted);
+    fprintf(stderr, "  trace entries: %ld\n", trace_entries);
+    for (Trace *t = traces; t; t = t->next) {
+        Value *name = vector_get(machine->program->values, t->method->name);
+        fprintf(stderr, "  %s @%d: %d instructions, %d exits, entered %ld times\n",
+                name->tag == STRING_VAL ? ((StringValue *)name)->value : "?",
+                t->head, t->length, t->nexits, t->entries);
+        for (int i = 0; i < t->nexits; i++) {
+            if (t->exitCounts[i] > 0) {
+                fprintf(stderr, "      exit to @%d taken %ld times\n", t->exitIps[i], t->exitCounts[i]);
+            }
+        }
+    }
+}
+
+#else
+
+int trace_loop_edge(Machine *machine, Instr *branch) {
+    return 0;
+}
+
+void print_trace_stats(Machine *machine) {
+    fprintf(stderr, "Trace statistics: the trace jit is only supported on x86-64 Linux\n");
+}
+
+#endif
@@ -4,6 +4,11 @@
  * otherwise, it will introduce redundant conversion into the whole implementation
  */
 #include "feeny/vm.h"
+#include "feeny/jit.h"
+#include "feeny/linker.h"
+#include "feeny/output.h"
+#include "feeny/sampler.h"
+#include "feeny/trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,9 +16,33 @@
 
 // #define EXEC_DEBUG 0
 // #define MEMORY_DEBUG 0
+// #define SEQUENCE_PROFILE 0
 
 #define MXARGS 32
+
+// Unchecked operand stack access, capacity is reserved by make_frame
+#define PUSH(v) (*machine->stack.top++ = (intptr_t)(v))
+#define POP() (*--machine->stack.top)
+
+/*
+ * Dispatch mode of runvm: with GCC's labels-as-values every handler jumps
+ * straight to the next one (threaded code). Define FEENY_SWITCH_DISPATCH to
+ * build the portable switch-based loop instead.
+ */
+#if defined(__GNUC__) && !defined(FEENY_SWITCH_DISPATCH)
+#define THREADED_DISPATCH 1
+#endif
+
+// Instructions that may end up in a generic call-slot and own an InlineCache
+#define IS_SEND_OP(op) ((op) == CALL_SLOT_OP || (op) == TAIL_CALL_SLOT_OP || ((op) >= ADD_INT_OP && (op) <= ARRAY_LEN_OP))
+
 Machine *machine = NULL;
+VMOptions vm_options = {0, DEFAULT_MAX_DEPTH, 0, 0, 0, 0, NULL, DEFAULT_SAMPLE_INTERVAL,
+                        DEFAULT_HEAP_INITIAL, 0, DEFAULT_GC_TARGET_OCCUPANCY};
+
+// Inline cache counters, reported with --ic-stats
+static long ic_hits = 0;
+static long ic_misses = 0;
 
 static void print_classes(Vector *classes) {
     for (int i = 0; i < vector_size(classes); i++) {
@@ -32,53 +61,124 @@ static void print_classes(Vector *classes) {
     }
 }
 
-static MethodValue *lookup_method(Machine *machine, ObjType type, char *method_name) {
-    Vector *pool = machine->program->values;
-
-    // Find the name(string) constant's index
-    TClass *classTemplate = NULL;
-    for (int i = 0; i < vector_size(machine->classes); i++) {
-        TClass *curTemplate = (TClass *)vector_get(machine->classes, i);
-        if (curTemplate->type == type) {
-            classTemplate = curTemplate;
-            break;
-        }
+static MethodValue *lookup_method(Machine *machine, ObjType type, int selector) {
+    if (selector < 0) {
+        return NULL;
     }
+
+    TClass *classTemplate = class_of_type(machine, type);
     if (!classTemplate) {
         fprintf(stderr, "Error: Unknown type in classes set!\n");
         exit(1);
     }
-    void *result = findByName(classTemplate->funcNameToPoolIndex, method_name);
-    if (!result) {
-        return NULL;
+    return (MethodValue *)classTemplate->methods[selector];
+}
+
+// Method lookup through the call site's inline cache
+static MethodValue *cached_lookup_method(Machine *machine, InlineCache *cache, ObjType type, int selector) {
+    for (int i = 0; i < cache->size; i++) {
+        if (cache->types[i] == type) {
+            ic_hits++;
+            return cache->methods[i];
+        }
     }
 
-    // Fetch the methodValue in the constant pool
-    Value *v = vector_get(pool, (int)(intptr_t)result);
-    if (v->tag != METHOD_VAL) {
-        fprintf(stderr, "Error: Given %s is not a method!\n", method_name);
-        exit(1);
+    ic_misses++;
+    MethodValue *method = lookup_method(machine, type, selector);
+    if (cache->size < IC_ENTRIES) {
+        cache->types[cache->size] = type;
+        cache->methods[cache->size] = method;
+        cache->size++;
+    } else {
+        cache->megamorphic = 1;
     }
-    return (MethodValue *)v;
+    return method;
 }
 
-static TClass *findClassByPoolIndex(Machine *machine, int index) {
-    for (int i = 0; i < vector_size(machine->classes); i++) {
-        TClass *templateClass = (TClass *)vector_get(machine->classes, i);
-        if (templateClass->poolIndex == index) {
-            return templateClass;
+static void print_ic_stats(Machine *machine) {
+    int mono = 0, poly = 0, mega = 0;
+    for (int i = 0; i < vector_size(machine->program->values); i++) {
+        MethodValue *method = (MethodValue *)vector_get(machine->program->values, i);
+        if (method->tag != METHOD_VAL || !method->ins) {
+            continue;
+        }
+        for (int j = 0; j < method->ninstr; j++) {
+            InlineCache *cache = (InlineCache *)method->ins[j].cache;
+            if (!IS_SEND_OP(base_opcode(method->ins[j].op)) || !cache || cache->size == 0) {
+                continue;
+            }
+            if (cache->megamorphic) {
+                mega++;
+            } else if (cache->size > 1) {
+                poly++;
+            } else {
+                mono++;
+            }
         }
     }
-    return NULL;
+
+    long total = ic_hits + ic_misses;
+    fprintf(stderr, "=== Inline Cache Statistics ===\n");
+    fprintf(stderr, "Lookups: %ld, hits: %ld (%.2f%%), misses: %ld\n",
+            total, ic_hits, total ? 100.0 * ic_hits / total : 0.0, ic_misses);
+    fprintf(stderr, "Object call sites: %d monomorphic, %d polymorphic, %d megamorphic\n",
+            mono, poly, mega);
 }
 
-static int findSlotIndex(Machine *machine, ObjType type, char *name) {
-    TClass *targetClass = NULL;
-    if (type == GLOBAL_TYPE) {
-        targetClass = (TClass *)vector_get(machine->classes, 0);
-    } else {
-        targetClass = (TClass *)vector_get(machine->classes, type - OBJECT_TYPE + 1);
+// Give every method its counters and link its first instruction to the
+// entry stub of the profiler
+static void start_profile(Machine *machine, void *entry) {
+    for (int i = 0; i < vector_size(machine->program->values); i++) {
+        MethodValue *method = (MethodValue *)vector_get(machine->program->values, i);
+        if (method->tag == METHOD_VAL) {
+            method->profile = calloc(1, sizeof(MethodProfile));
+            if (method->ninstr > 0) {
+                method->ins[0].handler = entry;
+            }
+        }
+    }
+}
+
+static int compare_profiles(const void *a, const void *b) {
+    MethodProfile *x = (MethodProfile *)(*(MethodValue **)a)->profile;
+    MethodProfile *y = (MethodProfile *)(*(MethodValue **)b)->profile;
+    if (x->instructions != y->instructions) {
+        return x->instructions < y->instructions ? 1 : -1;
     }
+    return (x->calls < y->calls) - (x->calls > y->calls);
+}
+
+static void print_profile(Machine *machine) {
+    Vector *values = machine->program->values;
+    MethodValue **methods = (MethodValue **)malloc(sizeof(MethodValue *) * (vector_size(values) + 1));
+    int n = 0;
+    long total = 0;
+    for (int i = 0; i < vector_size(values); i++) {
+        MethodValue *method = (MethodValue *)vector_get(values, i);
+        if (method->tag == METHOD_VAL && ((MethodProfile *)method->profile)->calls > 0) {
+            methods[n++] = method;
+            total += ((MethodProfile *)method->profile)->instructions;
+        }
+    }
+    qsort(methods, n, sizeof(MethodValue *), compare_profiles);
+
+    fprintf(stderr, "=== Profile ===\n");
+    fprintf(stderr, "%-24s %12s %14s %7s %14s\n", "method", "calls", "instructions", "%", "bytes");
+    for (int i = 0; i < n; i++) {
+        MethodProfile *profile = (MethodProfile *)methods[i]->profile;
+        Value *name = vector_get(values, methods[i]->name);
+        const char *str = name->tag == STRING_VAL ? ((StringValue *)name)->value : "?";
+        if (methods[i] == vector_get(values, machine->program->entry)) {
+            str = "<entry>";
+        }
+        fprintf(stderr, "%-24s %12ld %14ld %6.2f%% %14ld\n", str, profile->calls, profile->instructions,
+                total ? 100.0 * profile->instructions / total : 0.0, profile->bytes);
+    }
+    free(methods);
+}
+
+static int findSlotIndex(Machine *machine, ObjType type, char *name) {
+    TClass *targetClass = class_of_type(machine, type);
     for (int i = 0; i < vector_size(targetClass->varNames); i++) {
         if (strcmp(name, (char *)vector_get(targetClass->varNames, i)) == 0) {
             return i;
@@ -87,88 +187,217 @@ static int findSlotIndex(Machine *machine, ObjType type, char *name) {
     return -1;
 }
 
-// Core function: init a local frame, change machine's context
-static void make_frame(Machine *machine, MethodValue *method) {
-    // Allocate memory for new frame
-    int slots_num = method->nargs + method->nlocals;
-    Frame *frame = (Frame *)malloc(sizeof(Frame) + sizeof(intptr_t) * slots_num);
-    if (!frame) {
-        fprintf(stderr, "Memory allocation failed for new frame\n");
-        exit(1);
+// Slot offset lookup through the site's cache, names are only compared on a miss
+static int cached_slot_index(Machine *machine, SlotCache *cache, ObjType type, char *name) {
+    if (cache->type != type) {
+        int slotIndex = findSlotIndex(machine, type, name);
+        if (slotIndex < 0) {
+            fprintf(stderr, "Invalid slot access\n");
+            exit(1);
+        }
+        cache->type = type;
+        cache->index = slotIndex;
     }
+    return cache->index;
+}
 
-    // Initialize frame components
-    frame->parent = machine->cur; // Link to previous frame
-    frame->method = method;
-    frame->ra = machine->ip + 1; // Save current ip as return address
-    for (int i = 0; i < slots_num; i++) {
-        frame->locals[i] = 0;
+// Check an array index operand against the array's length
+static int checked_array_index(RArray *arr, intptr_t index) {
+    if (!IS_INT(index)) {
+        fprintf(stderr, "Error: Array index must be integer\n");
+        exit(1);
+    }
+    intptr_t arrayIndex = UNTAG_INT(index);
+    if (arrayIndex < 0 || (size_t)arrayIndex >= arr->length) {
+        fprintf(stderr, "Error: Array index %ld out of bounds for length %zu\n", arrayIndex, arr->length);
+        exit(1);
     }
+    return (int)arrayIndex;
+}
 
-    // Temporarily set machine state to scan labels
-    // Reset ip to start of new frame's code
-    machine->cur = frame;
-    machine->ip = 0;
+#define FRAME_STACK_SIZE (64 * 1024)
+#define OPERAND_STACK_SIZE 4096
 
-    // Scan through method's code to process all labels
-    if (method->processed == 1) {
-        return;
+static size_t frame_size(MethodValue *method) {
+    return sizeof(Frame) + sizeof(intptr_t) * (method->nargs + method->nlocals);
+}
+
+// Grow the frame stack to hold at least `needed` more bytes, rebasing frame links
+static void grow_frame_stack(FrameStack *frames, size_t needed) {
+    size_t used = frames->top - frames->base;
+    size_t capacity = frames->limit - frames->base;
+    while (capacity - used < needed) {
+        capacity <<= 1;
     }
-    Map *labels = newMap();
-    for (int i = 0; i < vector_size(method->code); i++) {
-        ByteIns *instr = vector_get(method->code, i);
-        if (instr->tag == LABEL_OP) {
-            LabelIns *labelIns = (LabelIns *)instr;
-            // Get the label string value from program's constant pool
-            Value *labelStr = vector_get(machine->program->values, labelIns->name);
-
-            // Verify the value is a string
-            if (labelStr->tag != STRING_VAL) {
-                fprintf(stderr, "Label instruction's name must be string\n");
-                exit(1);
+
+    char *base = (char *)realloc(frames->base, capacity);
+    if (!base) {
+        fprintf(stderr, "Memory allocation failed for frame stack\n");
+        exit(1);
+    }
+    intptr_t delta = base - frames->base;
+    if (delta != 0) {
+        for (char *p = base; p < base + used; p += frame_size(((Frame *)p)->method)) {
+            Frame *frame = (Frame *)p;
+            if (frame->parent) {
+                frame->parent = (Frame *)((char *)frame->parent + delta);
             }
-            StringValue *labelName = (StringValue *)labelStr;
+        }
+        if (machine->cur) {
+            machine->cur = (Frame *)((char *)machine->cur + delta);
+        }
+    }
+    frames->base = base;
+    frames->top = base + used;
+    frames->limit = base + capacity;
+}
 
-            // Extract the actual label string index and add to frame's label map
-            // Tuple: string -> lineNumber
-            addNewTuple(labels, labelName->value, (void *)(intptr_t)i);
+// Grow the operand stack so that `needed` more values fit above its top
+static void grow_operand_stack(OperandStack *stack, size_t needed) {
+    size_t used = stack->top - stack->base;
+    size_t capacity = stack->limit - stack->base;
+    while (capacity - used < needed) {
+        capacity <<= 1;
+    }
+
+    intptr_t *base = (intptr_t *)realloc(stack->base, sizeof(intptr_t) * capacity);
+    if (!base) {
+        fprintf(stderr, "Memory allocation failed for operand stack\n");
+        exit(1);
+    }
+    stack->base = base;
+    stack->top = base + used;
+    stack->limit = base + capacity;
+}
+
+#ifdef SEQUENCE_PROFILE
+/*
+ * Opcode pair and triple profiler
+ * Counts the sequences of opcodes executed in a row within one frame, used to
+ * choose which sequences are worth a superinstruction. Build with
+ * -DSEQUENCE_PROFILE, the linker then leaves the code unfused.
+ */
+static const char *opcode_names[OPCODE_COUNT] = {
+    "label", "lit", "printf", "array", "object", "slot", "set-slot",
+    "call-slot", "call", "set-local", "get-local", "set-global",
+    "get-global", "branch", "goto", "return", "drop", "add-int", "sub-int",
+    "mul-int", "div-int", "mod-int", "lt-int", "gt-int", "le-int",
+    "ge-int", "eq-int", "array-get", "array-set", "array-len",
+    "tail-call", "tail-call-slot",
+    "get-local-lit", "get-local-local", "get-global-local", "set-get-local",
+    "add-local-lit", "inc-local", "br-lt", "br-gt", "br-le", "br-ge",
+    "br-eq", "push-imm", "call-direct",
+    "tail-call-direct"};
+
+#define PROFILE_TOP 15
+
+static long pair_counts[OPCODE_COUNT][OPCODE_COUNT];
+static long triple_counts[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static int prev_ops[2] = {-1, -1};
+
+static void profile_instr(OpCode op) {
+    if (prev_ops[1] >= 0) {
+        pair_counts[prev_ops[1]][op]++;
+        if (prev_ops[0] >= 0) {
+            triple_counts[prev_ops[0]][prev_ops[1]][op]++;
         }
     }
+    prev_ops[0] = prev_ops[1];
+    prev_ops[1] = op;
+}
 
-    // Process all branch and goto byte instructions from name idx to true address
-    for (int i = 0; i < vector_size(method->code); i++) {
-        ByteIns *instr = vector_get(method->code, i);
-        switch (instr->tag) {
-        case BRANCH_OP: {
-            BranchIns *branchInstr = (BranchIns *)instr;
-            Value *branchLabelStr = vector_get(machine->program->values, branchInstr->name);
-            if (branchLabelStr->tag != STRING_VAL) {
-                fprintf(stderr, "Label instruction's name must be string\n");
-                exit(1);
+// Sequences do not continue across calls and returns
+static void profile_frame_switch() {
+    prev_ops[0] = prev_ops[1] = -1;
+}
+
+// Print the PROFILE_TOP most frequent entries of a flattened count table
+static void print_top_sequences(const char *title, long *counts, int n, int length) {
+    fprintf(stderr, "%s:\n", title);
+    for (int k = 0; k < PROFILE_TOP; k++) {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            if (counts[i] > 0 && (best < 0 || counts[i] > counts[best])) {
+                best = i;
             }
-            StringValue *branchLabelName = (StringValue *)branchLabelStr;
-            branchInstr->name = (int)(intptr_t)findByName(labels, branchLabelName->value);
+        }
+        if (best < 0) {
             break;
         }
-
-        case GOTO_OP: {
-            GotoIns *gotoInstr = (GotoIns *)instr;
-            Value *gotoLabelStr = vector_get(machine->program->values, gotoInstr->name);
-            if (gotoLabelStr->tag != STRING_VAL) {
-                fprintf(stderr, "Label instruction's name must be string\n");
-                exit(1);
+        fprintf(stderr, "  %12ld ", counts[best]);
+        for (int j = length - 1, rest = best; j >= 0; j--) {
+            int div = 1;
+            for (int d = 0; d < j; d++) {
+                div *= OPCODE_COUNT;
             }
-            StringValue *gotoLabelName = (StringValue *)gotoLabelStr;
-            gotoInstr->name = (int)(intptr_t)findByName(labels, gotoLabelName->value);
-            break;
+            fprintf(stderr, " %s", opcode_names[rest / div]);
+            rest %= div;
         }
-
-        default:
-            break;
+        fprintf(stderr, "\n");
+        counts[best] = -counts[best]; // Hide it from the next rounds
+    }
+    for (int i = 0; i < n; i++) {
+        if (counts[i] < 0) {
+            counts[i] = -counts[i];
         }
     }
-    freeMap(labels);
-    method->processed = 1;
+}
+
+static void print_sequence_profile() {
+    print_top_sequences("Opcode pairs", &pair_counts[0][0], OPCODE_COUNT * OPCODE_COUNT, 2);
+    print_top_sequences("Opcode triples", &triple_counts[0][0][0], OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT, 3);
+}
+#endif
+
+// Core function: push a local frame, change machine's context
+static void make_frame(Machine *machine, MethodValue *method) {
+    FrameStack *frames = &machine->frames;
+    if (frames->depth >= vm_options.max_depth) {
+        fprintf(stderr, "Error: Stack overflow, call depth exceeds %d frames\n", vm_options.max_depth);
+        exit(1);
+    }
+
+    size_t size = frame_size(method);
+    if (frames->top + size > frames->limit) {
+        grow_frame_stack(frames, size);
+    }
+    // The method's operands are pushed without bound checks
+    if (machine->stack.top + method->maxstack > machine->stack.limit) {
+        grow_operand_stack(&machine->stack, method->maxstack);
+    }
+
+    Frame *frame = (Frame *)frames->top;
+    frames->top += size;
+    frames->depth++;
+
+    // Initialize frame components, arguments are stored by the caller
+    frame->parent = machine->cur; // Link to previous frame
+    frame->method = method;
+    frame->ra = machine->ip + 1; // Save current ip as return address
+    memset(&frame->locals[method->nargs], 0, sizeof(intptr_t) * method->nlocals);
+
+    // Reset ip to start of new frame's code
+    machine->cur = frame;
+    machine->ip = 0;
+}
+
+// Tail call: the current frame becomes the frame of method, keeping its parent
+// and return address. It is the topmost frame, so it can grow or shrink in place.
+static void reuse_frame(Machine *machine, MethodValue *method) {
+    FrameStack *frames = &machine->frames;
+    size_t size = frame_size(method);
+    if ((char *)machine->cur + size > frames->limit) {
+        grow_frame_stack(frames, size - (frames->top - (char *)machine->cur));
+    }
+    if (machine->stack.top + method->maxstack > machine->stack.limit) {
+        grow_operand_stack(&machine->stack, method->maxstack);
+    }
+
+    Frame *frame = machine->cur;
+    frames->top = (char *)frame + size;
+    frame->method = method;
+    memset(&frame->locals[method->nargs], 0, sizeof(intptr_t) * method->nlocals);
+    machine->ip = 0;
 }
 
 static void addSlotInfo(Vector *pool, TClass *template, Vector *slots) {
@@ -205,16 +434,74 @@ static void addSlotInfo(Vector *pool, TClass *template, Vector *slots) {
     }
 }
 
+int selector_id(Machine *machine, char *name) {
+    for (int i = 0; i < vector_size(machine->selectors); i++) {
+        if (strcmp(name, (char *)vector_get(machine->selectors, i)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Intern the method names of all classes as selectors, then give every class a
+// table from selector to method, so a lookup is one indexed load per class
+static void buildMethodTables(Machine *machine) {
+    Vector *pool = machine->program->values;
+    machine->selectors = make_vector();
+    for (int i = 0; i < vector_size(machine->classes); i++) {
+        Map *funcs = ((TClass *)vector_get(machine->classes, i))->funcNameToPoolIndex;
+        for (int j = 0; j < vector_size(funcs->names); j++) {
+            char *name = (char *)vector_get(funcs->names, j);
+            if (selector_id(machine, name) < 0) {
+                vector_add(machine->selectors, name);
+            }
+        }
+    }
+
+    int nselectors = vector_size(machine->selectors);
+    for (int i = 0; i < vector_size(machine->classes); i++) {
+        TClass *template = (TClass *)vector_get(machine->classes, i);
+        template->methods = (void **)calloc(nselectors > 0 ? nselectors : 1, sizeof(void *));
+        Map *funcs = template->funcNameToPoolIndex;
+        for (int j = 0; j < vector_size(funcs->names); j++) {
+            char *name = (char *)vector_get(funcs->names, j);
+            Value *v = vector_get(pool, (int)(intptr_t)vector_get(funcs->values, j));
+            if (v->tag != METHOD_VAL) {
+                fprintf(stderr, "Error: Given %s is not a method!\n", name);
+                exit(1);
+            }
+            template->methods[selector_id(machine, name)] = v;
+        }
+    }
+}
+
 void initvm(Program *program) {
     if (!machine) {
         machine = (Machine *)malloc(sizeof(Machine));
     }
     machine->program = program;
     machine->global = NULL;
-    machine->stack = make_vector();
+    machine->stack.base = (intptr_t *)malloc(sizeof(intptr_t) * OPERAND_STACK_SIZE);
+    if (!machine->stack.base) {
+        fprintf(stderr, "Memory allocation failed for operand stack\n");
+        exit(1);
+    }
+    machine->stack.top = machine->stack.base;
+    machine->stack.limit = machine->stack.base + OPERAND_STACK_SIZE;
     machine->classes = make_vector();
     machine->cur = NULL;
     machine->ip = 0;
+    machine->handlers = NULL;
+
+    // Preallocate the call stack
+    machine->frames.base = (char *)malloc(FRAME_STACK_SIZE);
+    if (!machine->frames.base) {
+        fprintf(stderr, "Memory allocation failed for frame stack\n");
+        exit(1);
+    }
+    machine->frames.top = machine->frames.base;
+    machine->frames.limit = machine->frames.base + FRAME_STACK_SIZE;
+    machine->frames.depth = 0;
 
     // Attach all related classes info to virtual machine
     // Global can be seen as a special class and Object
@@ -226,163 +513,163 @@ void initvm(Program *program) {
         Value *value = (Value *)vector_get(program->values, i);
         if (value->tag == CLASS_VAL) {
             ClassValue *classValue = (ClassValue *)value;
+            // Object headers keep the type in 16 bits
+            if (OBJECT_TYPE + vector_size(machine->classes) - 1 > MAX_OBJ_TYPE) {
+                fprintf(stderr, "Error: Too many classes, at most %d\n", MAX_OBJ_TYPE - OBJECT_TYPE + 1);
+                exit(1);
+            }
             TClass *newTemplate = newTemplateClass(OBJECT_TYPE + vector_size(machine->classes) - 1, i);
             addSlotInfo(machine->program->values, newTemplate, classValue->slots);
             vector_add(machine->classes, newTemplate);
         }
     }
 
+    // Dense table from object type to template, shared with the collector
+    machine->ntypes = OBJECT_TYPE + vector_size(machine->classes) - 1;
+    machine->templates = (TClass **)calloc(machine->ntypes, sizeof(TClass *));
+    for (int i = 0; i < vector_size(machine->classes); i++) {
+        TClass *template = (TClass *)vector_get(machine->classes, i);
+        machine->templates[template->type] = template;
+    }
+    buildMethodTables(machine);
+
     // Initialize garbage collector
     init_heap();
     machine->global = (RClass *)UNTAG_PTR((intptr_t)newClassObj(GLOBAL_TYPE, vector_size(globalTemplate->varNames)));
 
-    // Init local frame
-    MethodValue *method = vector_get(program->values, program->entry);
-    make_frame(machine, method);
-    machine->cur->ra = -1;
-    machine->cur->parent = NULL;
+    // Resolve labels, names and globals of all methods up front
+    link_program(machine);
 }
 
-static void handle_lit_instr(Machine *machine, LitIns *ins) {
-    Value *value = vector_get(machine->program->values, ins->idx);
+// Rewrite an instruction into its quickened form once it ran. Instructions
+// linked to a stub (profiler entry) keep it, the stubs go on through the
+// dispatch table with the new opcode.
+static void quicken(Machine *machine, Instr *ins, OpCode op) {
+    OpCode old = ins->op;
+    ins->op = op;
+    if (machine->handlers && ins->handler == machine->handlers[old]) {
+        ins->handler = machine->handlers[op];
+    }
+}
+
+void handle_lit_instr(Machine *machine, Instr *ins) {
+    Value *value = (Value *)ins->ref;
     switch (value->tag) {
     case INT_VAL: {
         IntValue *int_value = (IntValue *)value;
-        vector_add(machine->stack, (void *)newIntObj(int_value->value));
+        PUSH(newIntObj(int_value->value));
         break;
     }
 
     case NULL_VAL:
-        vector_add(machine->stack, (void *)newNullObj());
+        PUSH(newNullObj());
         break;
     default:
         fprintf(stderr, "Only int or null object can be used in lit\n");
         exit(1);
     }
+    // The linker already tagged the literal into arg
+    quicken(machine, ins, PUSH_IMM_OP);
 }
 
 // Handle print instruction
-static void handle_print_instr(Machine *machine, PrintfIns *ins) {
-    Value *format = vector_get(machine->program->values, ins->format);
-    if (format->tag != STRING_VAL) {
-        fprintf(stderr, "Print format must be string\n");
-        exit(1);
-    }
+void handle_print_instr(Machine *machine, Instr *ins) {
 
     // Get arguments from stack
-    intptr_t args[MXARGS];
+    long args[MXARGS];
     for (int i = ins->arity - 1; i >= 0; i--) {
-        args[i] = (intptr_t)vector_pop(machine->stack);
-        if (!IS_INT(args[i])) {
+        intptr_t arg = POP();
+        if (!IS_INT(arg)) {
             printf("Error: printf only accepts integers\n");
             exit(1);
         }
+        args[i] = UNTAG_INT(arg);
     }
-    char *str_format = ((StringValue *)format)->value;
-    int idx = 0;
-    while (*str_format != '\0') {
-        if (*str_format == '~') {
-            printf("%ld", UNTAG_INT(args[idx++]));
-        } else {
-            putchar(*str_format);
-        }
-        str_format++;
+    PrintFormat *format = (PrintFormat *)ins->ref;
+    if (format->nholes != ins->arity) {
+        fprintf(stderr, "Error: printf format expects %d arguments, got %d\n", format->nholes, ins->arity);
+        exit(1);
     }
+    output_format(format, args);
 }
 
-static void handle_array_instr(Machine *machine) {
-    intptr_t init_val = (intptr_t)vector_pop(machine->stack);
-    intptr_t length_val = (intptr_t)vector_pop(machine->stack);
+void handle_array_instr(Machine *machine) {
+    intptr_t init_val = POP();
+    intptr_t length_val = POP();
 
     if (!IS_INT(length_val)) {
         fprintf(stderr, "Array length must be integer\n");
         exit(1);
     }
-    // !important: add inital_value to stack in case of GC can not see it
-    vector_add(machine->stack, (void *)init_val);
     RArray *array = newArrayObj((int)UNTAG_INT(length_val), (void *)init_val);
-    vector_pop(machine->stack);
-    vector_add(machine->stack, array);
+    PUSH(array);
 }
 
-static void handle_object_instr(Machine *machine, ObjectIns *ins) {
-    ClassValue *class = vector_get(machine->program->values, ins->class);
-    if (class->tag != CLASS_VAL) {
-        fprintf(stderr, "Object instruction requires class value\n");
-        exit(1);
-    }
-    TClass *classTemplate = findClassByPoolIndex(machine, ins->class);
-    if (!classTemplate) {
-        fprintf(stderr, "Error: unknown object type\n");
-        exit(1);
-    }
+void handle_object_instr(Machine *machine, Instr *ins) {
+    TClass *classTemplate = (TClass *)ins->ref;
 
     int slotNum = (int)(intptr_t)vector_size(classTemplate->varNames);
     RClass *instance = (RClass *)UNTAG_PTR((intptr_t)newClassObj(classTemplate->type, slotNum));
 
     // Pop initial values and parent
     for (int i = slotNum - 1; i >= 0; i--) {
-        instance->var_slots[i] = (intptr_t)vector_pop(machine->stack);
+        instance->var_slots[i] = POP();
+        write_barrier(instance, instance->var_slots[i]);
     }
-    instance->parent = (intptr_t)vector_pop(machine->stack);
-    vector_add(machine->stack, (void *)TAG_PTR((intptr_t)instance));
+    instance->parent = POP();
+    write_barrier(instance, instance->parent);
+    PUSH(TAG_PTR((intptr_t)instance));
 }
 
-static void handle_slot_instr(Machine *machine, SlotIns *ins) {
-    intptr_t target_addr = (intptr_t)vector_pop(machine->stack);
+void handle_slot_instr(Machine *machine, Instr *ins) {
+    intptr_t target_addr = POP();
     if (!IS_PTR(target_addr)) {
         fprintf(stderr, "Error: Slot requires object\n");
         exit(1);
     }
     RTObj *receiver = (RTObj *)UNTAG_PTR(target_addr);
-    if (receiver->type < OBJECT_TYPE) {
+    if (OBJ_TYPE(receiver) < OBJECT_TYPE) {
         fprintf(stderr, "Error: Get slot requires object\n");
         exit(1);
     }
 
-    char *slotName = ((StringValue *)vector_get(machine->program->values, ins->name))->value;
     RClass *instance = (RClass *)receiver;
-    int slotIndex = findSlotIndex(machine, instance->type, slotName);
-    if (slotIndex < 0) {
-        fprintf(stderr, "Invalid slot access\n");
-        exit(1);
-    }
-    vector_add(machine->stack, (void *)instance->var_slots[slotIndex]);
+    int slotIndex = cached_slot_index(machine, (SlotCache *)ins->cache, OBJ_TYPE(instance), (char *)ins->ref);
+    PUSH(instance->var_slots[slotIndex]);
 }
 
-static void handle_set_slot_instr(Machine *machine, SetSlotIns *ins) {
-    intptr_t value = (intptr_t)vector_pop(machine->stack);
-    intptr_t target_addr = (intptr_t)vector_pop(machine->stack);
+void handle_set_slot_instr(Machine *machine, Instr *ins) {
+    intptr_t value = POP();
+    intptr_t target_addr = POP();
     if (!IS_PTR(target_addr)) {
         fprintf(stderr, "Error: Set slot requires object\n");
         exit(1);
     }
     RTObj *receiver = (RTObj *)UNTAG_PTR(target_addr);
-    if (receiver->type < OBJECT_TYPE) {
+    if (OBJ_TYPE(receiver) < OBJECT_TYPE) {
         fprintf(stderr, "Error: Set slot requires object\n");
         exit(1);
     }
 
-    char *slotName = ((StringValue *)vector_get(machine->program->values, ins->name))->value;
     RClass *instance = (RClass *)receiver;
-    int slotIndex = findSlotIndex(machine, instance->type, slotName);
-    if (slotIndex < 0) {
-        fprintf(stderr, "Invalid slot access\n");
-        exit(1);
-    }
+    int slotIndex = cached_slot_index(machine, (SlotCache *)ins->cache, OBJ_TYPE(instance), (char *)ins->ref);
     instance->var_slots[slotIndex] = value;
+    write_barrier(instance, value);
+    // The assignment's value stays on the stack
+    PUSH(value);
 }
 
-static void handle_call_slot_instr(Machine *machine, CallSlotIns *ins) {
+// Call-slot, entering a method in a new frame or in place of the current one
+static inline void call_slot(Machine *machine, Instr *ins, int tail) {
     intptr_t args[MXARGS];
     int arg_count = ins->arity - 1;
     for (int i = 0; i < arg_count; i++) {
-        args[i] = (intptr_t)vector_pop(machine->stack);
+        args[i] = POP();
     }
 
-    intptr_t target = (intptr_t)vector_pop(machine->stack);
+    intptr_t target = POP();
 
-    char *slotName = ((StringValue *)vector_get(machine->program->values, ins->name))->value;
+    char *slotName = (char *)ins->ref;
 
     // Handle integer operations
     if (IS_INT(target)) {
@@ -432,7 +719,7 @@ static void handle_call_slot_instr(Machine *machine, CallSlotIns *ins) {
             exit(1);
         }
 
-        vector_add(machine->stack, (void *)result);
+        PUSH(result);
         machine->ip++;
         return;
     }
@@ -443,7 +730,7 @@ static void handle_call_slot_instr(Machine *machine, CallSlotIns *ins) {
         exit(1);
     }
     RTObj *receiver = (RTObj *)UNTAG_PTR(target);
-    if (receiver->type == ARRAY_TYPE) {
+    if (OBJ_TYPE(receiver) == ARRAY_TYPE) {
         RArray *arr = (RArray *)receiver;
 
         if (strcmp(slotName, "set") == 0) {
@@ -452,14 +739,10 @@ static void handle_call_slot_instr(Machine *machine, CallSlotIns *ins) {
                 exit(1);
             }
 
-            intptr_t index = args[1];
-            if (!IS_INT(index)) {
-                fprintf(stderr, "Error: Array index must be integer\n");
-                exit(1);
-            }
-
-            int arrayIndex = UNTAG_INT(index);
+            int arrayIndex = checked_array_index(arr, args[1]);
             arr->slots[arrayIndex] = args[0];
+            write_barrier(arr, args[0]);
+            PUSH(newNullObj());
 
         } else if (strcmp(slotName, "get") == 0) {
             if (ins->arity != 2) {
@@ -467,21 +750,15 @@ static void handle_call_slot_instr(Machine *machine, CallSlotIns *ins) {
                 exit(1);
             }
 
-            intptr_t index = args[0];
-            if (!IS_INT(index)) {
-                fprintf(stderr, "Error: Array index must be integer\n");
-                exit(1);
-            }
-
-            int arrayIndex = UNTAG_INT(index);
-            vector_add(machine->stack, (void *)arr->slots[arrayIndex]);
+            int arrayIndex = checked_array_index(arr, args[0]);
+            PUSH(arr->slots[arrayIndex]);
         } else if (strcmp(slotName, "length") == 0) {
             if (ins->arity != 1) {
                 fprintf(stderr, "Error: Array Object length operation takes no arguments\n");
                 exit(1);
             }
 
-            vector_add(machine->stack, (void *)newIntObj(arr->length));
+            PUSH(newIntObj(arr->length));
         } else {
             fprintf(stderr, "Error: Unsupported Array Object operation: %s\n", slotName);
             exit(1);
@@ -491,12 +768,12 @@ static void handle_call_slot_instr(Machine *machine, CallSlotIns *ins) {
     }
 
     // Handle object operations
-    if (receiver->type >= OBJECT_TYPE) {
+    if (OBJ_TYPE(receiver) >= OBJECT_TYPE) {
         RTObj *current = receiver;
         MethodValue *method = NULL;
 
         while (current) {
-            method = lookup_method(machine, current->type, slotName);
+            method = cached_lookup_method(machine, (InlineCache *)ins->cache, OBJ_TYPE(current), (int)ins->arg);
             if (method) {
                 break;
             }
@@ -521,7 +798,11 @@ static void handle_call_slot_instr(Machine *machine, CallSlotIns *ins) {
         }
 
         // Create new frame with receiver as parent
-        make_frame(machine, method);
+        if (tail) {
+            reuse_frame(machine, method);
+        } else {
+            make_frame(machine, method);
+        }
         machine->cur->locals[0] = target;
 
         for (int i = 0; i < ins->arity - 1; i++) {
@@ -533,169 +814,649 @@ static void handle_call_slot_instr(Machine *machine, CallSlotIns *ins) {
     }
 }
 
-static void handle_call_instr(Machine *machine, CallIns *ins) {
-    StringValue *funcName = vector_get(machine->program->values, ins->name);
-    if (funcName->tag != STRING_VAL) {
-        fprintf(stderr, "Error: Function name must be string\n");
-        exit(1);
-    }
+void handle_call_slot_instr(Machine *machine, Instr *ins) {
+    call_slot(machine, ins, 0);
+}
+
+void handle_tail_call_slot_instr(Machine *machine, Instr *ins) {
+    call_slot(machine, ins, 1);
+}
+
+// Global functions cannot be redefined, so a call's function is looked up
+// once and the call is quickened into its direct form
+static MethodValue *resolve_function(Machine *machine, Instr *ins, OpCode direct) {
+    char *funcName = (char *)ins->ref;
 
-    MethodValue *method = lookup_method(machine, GLOBAL_TYPE, funcName->value);
+    MethodValue *method = lookup_method(machine, GLOBAL_TYPE, (int)ins->arg);
     if (!method || method->tag != METHOD_VAL) {
-        fprintf(stderr, "Error: Undefined function: %s\n", funcName->value);
+        fprintf(stderr, "Error: Undefined function: %s\n", funcName);
         exit(1);
     }
     if (ins->arity != method->nargs) {
-        fprintf(stderr, "Wrong number of arguments for function %s\n", funcName->value);
+        fprintf(stderr, "Wrong number of arguments for function %s\n", funcName);
         exit(1);
     }
+    ins->cache = method;
+    quicken(machine, ins, direct);
+    return method;
+}
 
-    make_frame(machine, method);
+static inline void call_function(Machine *machine, Instr *ins, MethodValue *method, int tail) {
+    if (tail) {
+        reuse_frame(machine, method);
+    } else {
+        make_frame(machine, method);
+    }
     for (int i = 0; i < ins->arity; i++) {
-        machine->cur->locals[ins->arity - i - 1] = (intptr_t)vector_pop(machine->stack);
+        machine->cur->locals[ins->arity - i - 1] = POP();
     }
 }
-static void handle_get_local_instr(Machine *machine, GetLocalIns *ins) {
-    vector_add(machine->stack, (void *)machine->cur->locals[ins->idx]);
-}
-
-static void handle_set_local_instr(Machine *machine, SetLocalIns *ins) {
-    machine->cur->locals[ins->idx] = (intptr_t)vector_pop(machine->stack);
-}
-
-static void handle_get_global_instr(Machine *machine, GetGlobalIns *ins) {
-    StringValue *global = (StringValue *)vector_get(machine->program->values, ins->name);
-    if (global->tag != STRING_VAL) {
-        fprintf(stderr, "Error: Global variable should be string value!\n");
-        exit(1);
-    }
 
-    int slotIndex = findSlotIndex(machine, GLOBAL_TYPE, global->value);
-    vector_add(machine->stack, (void *)machine->global->var_slots[slotIndex]);
+void handle_call_instr(Machine *machine, Instr *ins) {
+    call_function(machine, ins, resolve_function(machine, ins, CALL_DIRECT_OP), 0);
 }
 
-static void handle_set_global_instr(Machine *machine, SetGlobalIns *ins) {
-    StringValue *global = (StringValue *)vector_get(machine->program->values, ins->name);
-    if (global->tag != STRING_VAL) {
-        fprintf(stderr, "Error: Global variable should be string value!\n");
-        exit(1);
-    }
-    int slotIndex = findSlotIndex(machine, GLOBAL_TYPE, global->value);
-    machine->global->var_slots[slotIndex] = (intptr_t)vector_pop(machine->stack);
+void handle_tail_call_instr(Machine *machine, Instr *ins) {
+    call_function(machine, ins, resolve_function(machine, ins, TAIL_CALL_DIRECT_OP), 1);
 }
 
-static void handle_goto_instr(Machine *machine, GotoIns *ins) {
-    machine->ip = (int)(intptr_t)ins->name;
+void handle_call_direct_instr(Machine *machine, Instr *ins) {
+    call_function(machine, ins, (MethodValue *)ins->cache, 0);
 }
 
-static void handle_branch_instr(Machine *machine, BranchIns *ins) {
-    intptr_t condition = (intptr_t)vector_pop(machine->stack);
-
-    if (!IS_NULL(condition)) {
-        machine->ip = (int)(intptr_t)ins->name;
-    } else {
-        machine->ip++;
-    }
+void handle_tail_call_direct_instr(Machine *machine, Instr *ins) {
+    call_function(machine, ins, (MethodValue *)ins->cache, 1);
 }
 
-static void handle_return_instr(Machine *machine) {
+void handle_return_instr(Machine *machine) {
     Frame *cur = machine->cur;
     machine->cur = cur->parent;
     machine->ip = cur->ra;
-    free(cur);
-}
-
-static void handle_drop_instr(Machine *machine) {
-    vector_pop(machine->stack);
+    machine->frames.top = (char *)cur;
+    machine->frames.depth--;
 }
 
 void runvm() {
-    Program *program = machine->program;
-
-    while (1) {
+#ifdef THREADED_DISPATCH
+    // Linked instructions carry the address of their handler, so every
+    // handler ends with an indirect jump straight to the next one
+    static void *dispatch_table[] = {
+        [LIT_OP] = &&L_LIT_OP,
+        [PRINTF_OP] = &&L_PRINTF_OP,
+        [ARRAY_OP] = &&L_ARRAY_OP,
+        [OBJECT_OP] = &&L_OBJECT_OP,
+        [SLOT_OP] = &&L_SLOT_OP,
+        [SET_SLOT_OP] = &&L_SET_SLOT_OP,
+        [CALL_SLOT_OP] = &&L_CALL_SLOT_OP,
+        [CALL_OP] = &&L_CALL_OP,
+        [SET_LOCAL_OP] = &&L_SET_LOCAL_OP,
+        [GET_LOCAL_OP] = &&L_GET_LOCAL_OP,
+        [SET_GLOBAL_OP] = &&L_SET_GLOBAL_OP,
+        [GET_GLOBAL_OP] = &&L_GET_GLOBAL_OP,
+        [BRANCH_OP] = &&L_BRANCH_OP,
+        [GOTO_OP] = &&L_GOTO_OP,
+        [RETURN_OP] = &&L_RETURN_OP,
+        [DROP_OP] = &&L_DROP_OP,
+        [ADD_INT_OP] = &&L_ADD_INT_OP,
+        [SUB_INT_OP] = &&L_SUB_INT_OP,
+        [MUL_INT_OP] = &&L_MUL_INT_OP,
+        [DIV_INT_OP] = &&L_DIV_INT_OP,
+        [MOD_INT_OP] = &&L_MOD_INT_OP,
+        [LT_INT_OP] = &&L_LT_INT_OP,
+        [GT_INT_OP] = &&L_GT_INT_OP,
+        [LE_INT_OP] = &&L_LE_INT_OP,
+        [GE_INT_OP] = &&L_GE_INT_OP,
+        [EQ_INT_OP] = &&L_EQ_INT_OP,
+        [ARRAY_GET_OP] = &&L_ARRAY_GET_OP,
+        [ARRAY_SET_OP] = &&L_ARRAY_SET_OP,
+        [ARRAY_LEN_OP] = &&L_ARRAY_LEN_OP,
+        [TAIL_CALL_OP] = &&L_TAIL_CALL_OP,
+        [TAIL_CALL_SLOT_OP] = &&L_TAIL_CALL_SLOT_OP,
+        [GET_LOCAL_LIT_OP] = &&L_GET_LOCAL_LIT_OP,
+        [GET_LOCAL_LOCAL_OP] = &&L_GET_LOCAL_LOCAL_OP,
+        [GET_GLOBAL_LOCAL_OP] = &&L_GET_GLOBAL_LOCAL_OP,
+        [SET_GET_LOCAL_OP] = &&L_SET_GET_LOCAL_OP,
+        [ADD_LOCAL_LIT_OP] = &&L_ADD_LOCAL_LIT_OP,
+        [INC_LOCAL_OP] = &&L_INC_LOCAL_OP,
+        [BR_LT_OP] = &&L_BR_LT_OP,
+        [BR_GT_OP] = &&L_BR_GT_OP,
+        [BR_LE_OP] = &&L_BR_LE_OP,
+        [BR_GE_OP] = &&L_BR_GE_OP,
+        [BR_EQ_OP] = &&L_BR_EQ_OP,
+        [PUSH_IMM_OP] = &&L_PUSH_IMM_OP,
+        [CALL_DIRECT_OP] = &&L_CALL_DIRECT_OP,
+        [TAIL_CALL_DIRECT_OP] = &&L_TAIL_CALL_DIRECT_OP,
+    };
+    machine->handlers = dispatch_table;
+    link_handlers(machine, dispatch_table);
+
+    // With --profile the code is linked to a counting stub per opcode, which
+    // goes on to the real handler with a direct jump. Without it the code is
+    // linked straight to the handlers, so the profiler costs nothing when off.
+    static void *profile_table[] = {
+        [LIT_OP] = &&P_LIT_OP,
+        [PRINTF_OP] = &&P_PRINTF_OP,
+        [ARRAY_OP] = &&P_ARRAY_OP,
+        [OBJECT_OP] = &&P_OBJECT_OP,
+        [SLOT_OP] = &&P_SLOT_OP,
+        [SET_SLOT_OP] = &&P_SET_SLOT_OP,
+        [CALL_SLOT_OP] = &&P_CALL_SLOT_OP,
+        [CALL_OP] = &&P_CALL_OP,
+        [SET_LOCAL_OP] = &&P_SET_LOCAL_OP,
+        [GET_LOCAL_OP] = &&P_GET_LOCAL_OP,
+        [SET_GLOBAL_OP] = &&P_SET_GLOBAL_OP,
+        [GET_GLOBAL_OP] = &&P_GET_GLOBAL_OP,
+        [BRANCH_OP] = &&P_BRANCH_OP,
+        [GOTO_OP] = &&P_GOTO_OP,
+        [RETURN_OP] = &&P_RETURN_OP,
+        [DROP_OP] = &&P_DROP_OP,
+        [ADD_INT_OP] = &&P_ADD_INT_OP,
+        [SUB_INT_OP] = &&P_SUB_INT_OP,
+        [MUL_INT_OP] = &&P_MUL_INT_OP,
+        [DIV_INT_OP] = &&P_DIV_INT_OP,
+        [MOD_INT_OP] = &&P_MOD_INT_OP,
+        [LT_INT_OP] = &&P_LT_INT_OP,
+        [GT_INT_OP] = &&P_GT_INT_OP,
+        [LE_INT_OP] = &&P_LE_INT_OP,
+        [GE_INT_OP] = &&P_GE_INT_OP,
+        [EQ_INT_OP] = &&P_EQ_INT_OP,
+        [ARRAY_GET_OP] = &&P_ARRAY_GET_OP,
+        [ARRAY_SET_OP] = &&P_ARRAY_SET_OP,
+        [ARRAY_LEN_OP] = &&P_ARRAY_LEN_OP,
+        [TAIL_CALL_OP] = &&P_TAIL_CALL_OP,
+        [TAIL_CALL_SLOT_OP] = &&P_TAIL_CALL_SLOT_OP,
+        [GET_LOCAL_LIT_OP] = &&P_GET_LOCAL_LIT_OP,
+        [GET_LOCAL_LOCAL_OP] = &&P_GET_LOCAL_LOCAL_OP,
+        [GET_GLOBAL_LOCAL_OP] = &&P_GET_GLOBAL_LOCAL_OP,
+        [SET_GET_LOCAL_OP] = &&P_SET_GET_LOCAL_OP,
+        [ADD_LOCAL_LIT_OP] = &&P_ADD_LOCAL_LIT_OP,
+        [INC_LOCAL_OP] = &&P_INC_LOCAL_OP,
+        [BR_LT_OP] = &&P_BR_LT_OP,
+        [BR_GT_OP] = &&P_BR_GT_OP,
+        [BR_LE_OP] = &&P_BR_LE_OP,
+        [BR_GE_OP] = &&P_BR_GE_OP,
+        [BR_EQ_OP] = &&P_BR_EQ_OP,
+        [PUSH_IMM_OP] = &&P_PUSH_IMM_OP,
+        [CALL_DIRECT_OP] = &&P_CALL_DIRECT_OP,
+        [TAIL_CALL_DIRECT_OP] = &&P_TAIL_CALL_DIRECT_OP,
+    };
+    MethodProfile *profile = NULL; // Counters of the running method
+    long profile_count = 0;        // Instructions not yet added to profile
+    if (vm_options.profile) {
+        // Quickened instructions are relinked to their counting stubs
+        machine->handlers = profile_table;
+        link_handlers(machine, profile_table);
+        start_profile(machine, &&P_ENTRY);
+    }
+    // With --sample branches, calls and returns go through L_SAMPLE, which
+    // records the stack when the timer ticked since
+    static void *sample_table[OPCODE_COUNT];
+    if (vm_options.sample_file) {
+        static const OpCode safe_points[] = {
+            BRANCH_OP, GOTO_OP, BR_LT_OP, BR_GT_OP, BR_LE_OP, BR_GE_OP, BR_EQ_OP,
+            CALL_OP, CALL_SLOT_OP, CALL_DIRECT_OP, TAIL_CALL_OP, TAIL_CALL_SLOT_OP,
+            TAIL_CALL_DIRECT_OP, RETURN_OP};
+        memcpy(sample_table, dispatch_table, sizeof(sample_table));
+        for (size_t i = 0; i < sizeof(safe_points) / sizeof(safe_points[0]); i++) {
+            sample_table[safe_points[i]] = &&L_SAMPLE;
+        }
+        // Quickened calls are relinked to the stub too
+        machine->handlers = sample_table;
+        link_handlers(machine, sample_table);
+        start_sampler();
+    }
+#define CASE(op) L_##op:
+#define DISPATCH()              \
+    do {                        \
+        TRACE_INSTR();          \
+        goto *pc->handler;      \
+    } while (0)
+#else
+#define CASE(op) case op:
+#define DISPATCH() goto dispatch
+    if (vm_options.profile) {
+        fprintf(stderr, "Error: --profile needs the threaded dispatch build\n");
+        exit(1);
+    }
+    if (vm_options.sample_file) {
+        fprintf(stderr, "Error: --sample needs the threaded dispatch build\n");
+        exit(1);
+    }
+#endif
 
 #ifdef EXEC_DEBUG
-        printf("cur ip: %ld\n", machine->ip);
+#define TRACE_INSTR()                                                   \
+    do {                                                                \
+        if (pc - code >= machine->cur->method->ninstr) {                \
+            fprintf(stderr, "Error: execute bytecodes out of bound!\n"); \
+            exit(1);                                                    \
+        }                                                               \
+        printf("cur ip: %ld, op: %d\n", (long)(pc - code), pc->op);     \
+    } while (0)
+#elif defined(SEQUENCE_PROFILE)
+#define TRACE_INSTR() profile_instr(pc->op)
+#else
+#define TRACE_INSTR()
 #endif
-        // When encounter the end of current frame, break the loop
-        if (machine->ip == -1 && machine->cur == NULL) {
-            break;
-        }
-        if (machine->ip >= vector_size(machine->cur->method->code)) {
-            fprintf(stderr, "Error: execute bytecodes out of bound!\n");
-            exit(1);
-        }
 
-        ByteIns *instr = (ByteIns *)vector_get(machine->cur->method->code, machine->ip);
+// Straight-line instructions fall through to the next one
+#define NEXT()          \
+    do {                \
+        pc++;           \
+        DISPATCH();     \
+    } while (0)
+
+// Superinstructions continue after the last instruction they fused
+#define SKIP(n)         \
+    do {                \
+        pc += (n);      \
+        DISPATCH();     \
+    } while (0)
+
+// Handlers that switch frames work on machine->ip
+#define SYNC_IP() (machine->ip = pc - code)
+
+#ifdef SEQUENCE_PROFILE
+#define PROFILE_FRAME_SWITCH() profile_frame_switch()
+#else
+#define PROFILE_FRAME_SWITCH()
+#endif
 
-#ifdef EXEC_DEBUG
-        print_ins(instr);
-        printf("\n");
+// Calls and returns switch frames, so the code base has to be reloaded
+#define RELOAD_CODE()                                   \
+    do {                                                \
+        if (machine->cur == NULL) {                     \
+            goto halt;                                  \
+        }                                               \
+        code = machine->cur->method->ins;               \
+        pc = code + machine->ip;                        \
+        PROFILE_FRAME_SWITCH();                         \
+        DISPATCH();                                     \
+    } while (0)
+
+// The operand stack top lives in a local register, it is written back to the
+// machine around handlers that use the stack or may trigger a collection
+#define SAVE_SP() (machine->stack.top = sp)
+#define LOAD_SP() (sp = machine->stack.top)
+#define CALL_HANDLER(call) \
+    do {                   \
+        SAVE_SP();         \
+        call;              \
+        LOAD_SP();         \
+    } while (0)
+
+// Operand stack access for the inline fast paths, 0 is the top
+#define STACK_AT(n) (sp[-1 - (n)])
+
+// Integer fast path: replace the two topmost values by the result of expr on
+// x and y, or fall back to a generic call-slot when either one is not an int
+#define INT_BINOP(expr)                     \
+    do {                                    \
+        intptr_t x = STACK_AT(1);           \
+        intptr_t y = STACK_AT(0);           \
+        if (!IS_INT(x) || !IS_INT(y)) {     \
+            goto generic_send;              \
+        }                                   \
+        sp--;                               \
+        STACK_AT(0) = (expr);               \
+        NEXT();                             \
+    } while (0)
+
+// Comparisons yield int 0 for true and null for false
+#define INT_BOOL(c) ((c) ? TAG_INT(0) : NULL_TAG)
+
+// Array intrinsics only handle array receivers, others take the generic call-slot
+#define IS_ARRAY(v) (IS_PTR(v) && OBJ_TYPE(UNTAG_PTR(v)) == ARRAY_TYPE)
+
+    // Enter the program's entry method
+    MethodValue *entry = vector_get(machine->program->values, machine->program->entry);
+    make_frame(machine, entry);
+    machine->cur->ra = -1;
+
+    Instr *code = machine->cur->method->ins;
+    Instr *pc = code;
+    intptr_t *sp = machine->stack.top;
+
+    if (vm_options.jit) {
+        jit_run(machine);
+        goto halt;
+    }
+
+#ifdef THREADED_DISPATCH
+    DISPATCH();
+#else
+dispatch:
+    TRACE_INSTR();
+    switch (pc->op) {
 #endif
-        switch (instr->tag) {
-        case LABEL_OP:
-            break;
-        case LIT_OP:
-            handle_lit_instr(machine, (LitIns *)instr);
-            break;
-        case PRINTF_OP:
-            handle_print_instr(machine, (PrintfIns *)instr);
-            break;
-        case ARRAY_OP:
-            handle_array_instr(machine);
-            break;
-        case OBJECT_OP:
-            handle_object_instr(machine, (ObjectIns *)instr);
-            break;
-        case SLOT_OP:
-            handle_slot_instr(machine, (SlotIns *)instr);
-            break;
-        case SET_SLOT_OP:
-            handle_set_slot_instr(machine, (SetSlotIns *)instr);
-            break;
-        case CALL_SLOT_OP:
-            handle_call_slot_instr(machine, (CallSlotIns *)instr);
-            continue;
-            break;
-        case CALL_OP:
-            handle_call_instr(machine, (CallIns *)instr);
-            continue;
-            break;
-        case GET_LOCAL_OP:
-            handle_get_local_instr(machine, (GetLocalIns *)instr);
-            break;
-        case SET_LOCAL_OP:
-            handle_set_local_instr(machine, (SetLocalIns *)instr);
-            break;
-        case GET_GLOBAL_OP:
-            handle_get_global_instr(machine, (GetGlobalIns *)instr);
-            break;
-        case SET_GLOBAL_OP:
-            handle_set_global_instr(machine, (SetGlobalIns *)instr);
-            break;
-        case GOTO_OP:
-            handle_goto_instr(machine, (GotoIns *)instr);
-            continue;
-            break;
-        case BRANCH_OP:
-            handle_branch_instr(machine, (BranchIns *)instr);
-            continue;
-            break;
-        case RETURN_OP:
-            handle_return_instr(machine);
-            continue;
-            break;
-        case DROP_OP:
-            handle_drop_instr(machine);
-            break;
-        default:
-            fprintf(stderr, "Unknown instruction: %d\n", instr->tag);
-            exit(1);
+    CASE(LIT_OP)
+        CALL_HANDLER(handle_lit_instr(machine, pc));
+        NEXT();
+    CASE(PRINTF_OP)
+        CALL_HANDLER(handle_print_instr(machine, pc));
+        NEXT();
+    CASE(ARRAY_OP)
+        CALL_HANDLER(handle_array_instr(machine));
+        NEXT();
+    CASE(OBJECT_OP)
+        CALL_HANDLER(handle_object_instr(machine, pc));
+        NEXT();
+    CASE(SLOT_OP)
+        CALL_HANDLER(handle_slot_instr(machine, pc));
+        NEXT();
+    CASE(SET_SLOT_OP)
+        CALL_HANDLER(handle_set_slot_instr(machine, pc));
+        NEXT();
+    CASE(CALL_SLOT_OP)
+    generic_send:
+        SYNC_IP();
+        CALL_HANDLER(handle_call_slot_instr(machine, pc));
+        RELOAD_CODE();
+    CASE(CALL_OP)
+        SYNC_IP();
+        CALL_HANDLER(handle_call_instr(machine, pc));
+        RELOAD_CODE();
+    CASE(TAIL_CALL_SLOT_OP)
+        SYNC_IP();
+        CALL_HANDLER(handle_tail_call_slot_instr(machine, pc));
+        RELOAD_CODE();
+    CASE(TAIL_CALL_OP)
+        SYNC_IP();
+        CALL_HANDLER(handle_tail_call_instr(machine, pc));
+        RELOAD_CODE();
+    CASE(PUSH_IMM_OP)
+        *sp++ = pc->arg;
+        NEXT();
+    CASE(CALL_DIRECT_OP)
+        SYNC_IP();
+        CALL_HANDLER(handle_call_direct_instr(machine, pc));
+        RELOAD_CODE();
+    CASE(TAIL_CALL_DIRECT_OP)
+        SYNC_IP();
+        CALL_HANDLER(handle_tail_call_direct_instr(machine, pc));
+        RELOAD_CODE();
+    CASE(GET_LOCAL_OP)
+        *sp++ = machine->cur->locals[pc->arg];
+        NEXT();
+    CASE(SET_LOCAL_OP)
+        machine->cur->locals[pc->arg] = *--sp;
+        NEXT();
+    CASE(GET_GLOBAL_OP)
+        *sp++ = machine->global->var_slots[pc->arg];
+        NEXT();
+    CASE(SET_GLOBAL_OP)
+        machine->global->var_slots[pc->arg] = *--sp;
+        NEXT();
+    CASE(GOTO_OP)
+        pc = code + pc->arg;
+        DISPATCH();
+    CASE(BRANCH_OP) {
+        intptr_t condition = *--sp;
+        if (IS_NULL(condition)) {
+            pc++;
+            DISPATCH();
         }
-        machine->ip++;
+        // Taken backward branch, the trace jit may run the loop natively
+        if (vm_options.trace_jit && pc->cache) {
+            SAVE_SP();
+            machine->ip = pc - code;
+            if (trace_loop_edge(machine, pc)) {
+                LOAD_SP();
+                pc = code + machine->ip;
+                DISPATCH();
+            }
+        }
+        pc = code + pc->arg;
+        DISPATCH();
+    }
+    CASE(RETURN_OP)
+        handle_return_instr(machine);
+        RELOAD_CODE();
+    CASE(DROP_OP)
+        sp--;
+        NEXT();
+    CASE(ADD_INT_OP)
+        // f(x+y) = 8(x+y) = 8x + 8y = f(x) + f(y)
+        INT_BINOP(x + y);
+    CASE(SUB_INT_OP)
+        INT_BINOP(x - y);
+    CASE(MUL_INT_OP)
+        // f(x*y) = 8(x*y) = 8x * y = f(x) * y
+        INT_BINOP(x * UNTAG_INT(y));
+    CASE(DIV_INT_OP)
+        INT_BINOP(TAG_INT(UNTAG_INT(x) / UNTAG_INT(y)));
+    CASE(MOD_INT_OP)
+        INT_BINOP(TAG_INT(UNTAG_INT(x) % UNTAG_INT(y)));
+    CASE(LT_INT_OP)
+        // Tagging keeps the order of ints, so compare the tagged words
+        INT_BINOP(INT_BOOL(x < y));
+    CASE(GT_INT_OP)
+        INT_BINOP(INT_BOOL(x > y));
+    CASE(LE_INT_OP)
+        INT_BINOP(INT_BOOL(x <= y));
+    CASE(GE_INT_OP)
+        INT_BINOP(INT_BOOL(x >= y));
+    CASE(EQ_INT_OP)
+        INT_BINOP(INT_BOOL(x == y));
+    CASE(ARRAY_GET_OP) {
+        if (!IS_ARRAY(STACK_AT(1))) {
+            goto generic_send;
+        }
+        RArray *arr = (RArray *)UNTAG_PTR(STACK_AT(1));
+        int index = checked_array_index(arr, STACK_AT(0));
+        sp--;
+        STACK_AT(0) = arr->slots[index];
+        NEXT();
+    }
+    CASE(ARRAY_SET_OP) {
+        // Like the generic set, leaves null on the stack
+        if (!IS_ARRAY(STACK_AT(2))) {
+            goto generic_send;
+        }
+        RArray *arr = (RArray *)UNTAG_PTR(STACK_AT(2));
+        int index = checked_array_index(arr, STACK_AT(1));
+        arr->slots[index] = STACK_AT(0);
+        write_barrier(arr, STACK_AT(0));
+        sp -= 2;
+        STACK_AT(0) = NULL_TAG;
+        NEXT();
+    }
+    CASE(ARRAY_LEN_OP) {
+        if (!IS_ARRAY(STACK_AT(0))) {
+            goto generic_send;
+        }
+        RArray *arr = (RArray *)UNTAG_PTR(STACK_AT(0));
+        STACK_AT(0) = newIntObj(arr->length);
+        NEXT();
+    }
+    CASE(GET_LOCAL_LIT_OP)
+        sp[0] = machine->cur->locals[pc[0].arg];
+        sp[1] = pc[1].arg;
+        sp += 2;
+        SKIP(2);
+    CASE(GET_LOCAL_LOCAL_OP)
+        sp[0] = machine->cur->locals[pc[0].arg];
+        sp[1] = machine->cur->locals[pc[1].arg];
+        sp += 2;
+        SKIP(2);
+    CASE(GET_GLOBAL_LOCAL_OP)
+        sp[0] = machine->global->var_slots[pc[0].arg];
+        sp[1] = machine->cur->locals[pc[1].arg];
+        sp += 2;
+        SKIP(2);
+    CASE(SET_GET_LOCAL_OP)
+        machine->cur->locals[pc[0].arg] = sp[-1];
+        sp[-1] = machine->cur->locals[pc[1].arg];
+        SKIP(2);
+// Local plus literal, falls back to the fused add-int's generic call-slot with
+// both operands pushed when either one is not an int
+#define LOCAL_ADD_LIT(result)                   \
+    do {                                        \
+        intptr_t x = machine->cur->locals[pc[0].arg]; \
+        intptr_t y = pc[1].arg;                 \
+        if (!IS_INT(x) || !IS_INT(y)) {         \
+            sp[0] = x;                          \
+            sp[1] = y;                          \
+            sp += 2;                            \
+            pc += 2;                            \
+            goto generic_send;                  \
+        }                                       \
+        result = x + y;                         \
+    } while (0)
+    CASE(ADD_LOCAL_LIT_OP)
+        LOCAL_ADD_LIT(*sp++);
+        SKIP(3);
+    CASE(INC_LOCAL_OP)
+        LOCAL_ADD_LIT(machine->cur->locals[pc[3].arg]);
+        SKIP(4);
+// Comparison and branch on two ints without the boolean in between, other
+// operands take the fused comparison's generic call-slot, which leaves the
+// result for the branch after it
+#define INT_BRANCH(cond)                    \
+    do {                                    \
+        intptr_t x = STACK_AT(1);           \
+        intptr_t y = STACK_AT(0);           \
+        if (!IS_INT(x) || !IS_INT(y)) {     \
+            goto generic_send;              \
+        }                                   \
+        sp -= 2;                            \
+        if (cond) {                         \
+            pc = code + pc[1].arg;          \
+            DISPATCH();                     \
+        }                                   \
+        SKIP(2);                            \
+    } while (0)
+    CASE(BR_LT_OP)
+        INT_BRANCH(x < y);
+    CASE(BR_GT_OP)
+        INT_BRANCH(x > y);
+    CASE(BR_LE_OP)
+        INT_BRANCH(x <= y);
+    CASE(BR_GE_OP)
+        INT_BRANCH(x >= y);
+    CASE(BR_EQ_OP)
+        INT_BRANCH(x == y);
+#ifdef THREADED_DISPATCH
+// Instructions are counted in a register and added to the running method's
+// counters when it calls or returns
+#define PROFILE_FLUSH()                                   \
+    do {                                                  \
+        if (profile) {                                    \
+            profile->instructions += profile_count;       \
+        }                                                 \
+        profile_count = 0;                                \
+    } while (0)
+#define PROFILE_STUB(op) \
+    P_##op:              \
+    profile_count++;     \
+    goto L_##op;
+    PROFILE_STUB(LIT_OP)
+    PROFILE_STUB(PRINTF_OP)
+    PROFILE_STUB(SLOT_OP)
+    PROFILE_STUB(SET_SLOT_OP)
+    PROFILE_STUB(CALL_SLOT_OP)
+    PROFILE_STUB(CALL_OP)
+    PROFILE_STUB(SET_LOCAL_OP)
+    PROFILE_STUB(GET_LOCAL_OP)
+    PROFILE_STUB(SET_GLOBAL_OP)
+    PROFILE_STUB(GET_GLOBAL_OP)
+    PROFILE_STUB(BRANCH_OP)
+    PROFILE_STUB(GOTO_OP)
+    PROFILE_STUB(DROP_OP)
+    PROFILE_STUB(ADD_INT_OP)
+    PROFILE_STUB(SUB_INT_OP)
+    PROFILE_STUB(MUL_INT_OP)
+    PROFILE_STUB(DIV_INT_OP)
+    PROFILE_STUB(MOD_INT_OP)
+    PROFILE_STUB(LT_INT_OP)
+    PROFILE_STUB(GT_INT_OP)
+    PROFILE_STUB(LE_INT_OP)
+    PROFILE_STUB(GE_INT_OP)
+    PROFILE_STUB(EQ_INT_OP)
+    PROFILE_STUB(ARRAY_GET_OP)
+    PROFILE_STUB(ARRAY_SET_OP)
+    PROFILE_STUB(ARRAY_LEN_OP)
+    PROFILE_STUB(TAIL_CALL_OP)
+    PROFILE_STUB(TAIL_CALL_SLOT_OP)
+    PROFILE_STUB(GET_LOCAL_LIT_OP)
+    PROFILE_STUB(GET_LOCAL_LOCAL_OP)
+    PROFILE_STUB(GET_GLOBAL_LOCAL_OP)
+    PROFILE_STUB(SET_GET_LOCAL_OP)
+    PROFILE_STUB(ADD_LOCAL_LIT_OP)
+    PROFILE_STUB(INC_LOCAL_OP)
+    PROFILE_STUB(BR_LT_OP)
+    PROFILE_STUB(BR_GT_OP)
+    PROFILE_STUB(BR_LE_OP)
+    PROFILE_STUB(BR_GE_OP)
+    PROFILE_STUB(BR_EQ_OP)
+    PROFILE_STUB(PUSH_IMM_OP)
+    PROFILE_STUB(CALL_DIRECT_OP)
+    PROFILE_STUB(TAIL_CALL_DIRECT_OP)
+// Linked to the first instruction of every method. The compiler never
+// branches there, so reaching it means the method was just called
+P_ENTRY:
+    PROFILE_FLUSH();
+    profile = (MethodProfile *)machine->cur->method->profile;
+    profile->calls++;
+    profile_count++;
+    goto *dispatch_table[pc->op];
+P_RETURN_OP:
+    profile_count++;
+    PROFILE_FLUSH();
+    handle_return_instr(machine);
+    profile = machine->cur ? (MethodProfile *)machine->cur->method->profile : NULL;
+    RELOAD_CODE();
+// Only array and object allocate on the heap, their stubs run them directly
+#define PROFILE_ALLOC(call)                           \
+    do {                                              \
+        size_t before = total_bytes;                  \
+        CALL_HANDLER(call);                           \
+        profile->bytes += total_bytes - before;       \
+    } while (0)
+P_ARRAY_OP:
+    profile_count++;
+    PROFILE_ALLOC(handle_array_instr(machine));
+    NEXT();
+P_OBJECT_OP:
+    profile_count++;
+    PROFILE_ALLOC(handle_object_instr(machine, pc));
+    NEXT();
+L_SAMPLE:
+    if (sample_pending) {
+        take_sample(machine, (int)(pc - code));
+    }
+    goto *dispatch_table[pc->op];
+#else
+    default:
+        fprintf(stderr, "Unknown instruction: %d\n", pc->op);
+        exit(1);
+    }
+#endif
+
+halt:
+#ifdef THREADED_DISPATCH
+    if (vm_options.profile) {
+        if (profile) {
+            profile->instructions += profile_count;
+        }
+        print_profile(machine);
+    }
+    if (vm_options.sample_file) {
+        stop_sampler(machine);
     }
+#endif
+    if (vm_options.ic_stats) {
+        print_ic_stats(machine);
+    }
+    if (vm_options.trace_stats) {
+        print_trace_stats(machine);
+    }
+#ifdef SEQUENCE_PROFILE
+    print_sequence_profile();
+#endif
 #ifdef MEMORY_DEBUG
     print_detailed_memory();
     print_heap_objects();
 #endif
+    return;
 }
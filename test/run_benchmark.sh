@@ -0,0 +1,39 @@
+# Compile both dispatch modes
+cd ../
+make compile
+make compile_switch
+cd test
+
+# Time every program with the threaded and the switch dispatch loop
+TIMEFORMAT=%R
+function bench {
+    threaded=$( { time ../bin/cfeeny -f ./$1.feeny > /dev/null; } 2>&1 )
+    switch=$( { time ../bin/cfeeny-switch -f ./$1.feeny > /dev/null; } 2>&1 )
+    printf "%-12s %10s %10s\n" $1 $threaded $switch
+}
+printf "%-12s %10s %10s\n" "program" "threaded" "switch"
+bench hello
+bench hello2
+bench hello3
+bench hello4
+bench hello5
+bench hello6
+bench hello7
+bench hello8
+bench hello9
+bench cplx
+bench bsearch
+bench fibonacci
+bench inheritance
+bench lists
+bench vector
+bench sudoku
+bench sudoku3
+bench hanoi
+bench morehanoi
+bench stack
+bench sudoku2
+bench loops
+bench tailcall
+bench gcclasses
+bench generations
@@ -22,23 +22,64 @@ function test {
     echo "Running bytecode compiler on $1.feeny"
     ../bin/cfeeny -f ./$1.feeny > ../output/bytecode_compiler/$1.out
 }
-test hello
-test hello2
-test hello3
-test hello4
-test hello5
-test hello6
-test hello7
-test hello8
-test hello9
-test cplx
-test bsearch
-test fibonacci
-test inheritance
-test lists
-test vector
-test sudoku
-test sudoku3
-test hanoi
-test morehanoi
-test stack
+programs="hello hello2 hello3 hello4 hello5 hello6 hello7 hello8 hello9 cplx bsearch fibonacci inheritance lists vector sudoku sudoku3 hanoi morehanoi stack loops tailcall gcclasses generations"
+for program in $programs; do
+    test $program
+done
+
+# Other modes of the vm must print exactly what -f prints
+failed=0
+function same_output {
+    if ! cmp -s ../output/bytecode_compiler/$2 ../output/bytecode_compiler/$1.out; then
+        echo "FAILED: $2 differs from the -f output of $1.feeny"
+        failed=1
+    fi
+}
+function has_report {
+    if ! grep -q "$2" $1; then
+        echo "FAILED: $1 has no \"$2\""
+        failed=1
+    fi
+}
+
+# The baseline jit
+for program in $programs; do
+    echo "Running baseline jit on $program.feeny"
+    ../bin/cfeeny -j ./$program.feeny > ../output/bytecode_compiler/${program}_jit.out
+    same_output $program ${program}_jit.out
+done
+
+# The trace jit, on loops that record, guard and exit their traces
+for program in loops bsearch sudoku; do
+    echo "Running trace jit on $program.feeny"
+    ../bin/cfeeny --trace-jit --trace-stats ./$program.feeny > ../output/bytecode_compiler/${program}_trace.out 2> ../output/bytecode_compiler/${program}_trace.err
+    same_output $program ${program}_trace.out
+done
+has_report ../output/bytecode_compiler/loops_trace.err "traces compiled: [1-9]"
+
+# The collector tests again within a small heap limit and an address space limit
+echo "Running bytecode compiler on generations.feeny with --heap-max 4m"
+../bin/cfeeny -f --heap-max 4m ./generations.feeny > ../output/bytecode_compiler/generations_heap_max.out
+echo "Running bytecode compiler on gcclasses.feeny with ulimit -v 4000000"
+(ulimit -v 4000000 && ../bin/cfeeny -f ./gcclasses.feeny > ../output/bytecode_compiler/gcclasses_ulimit.out)
+
+# --ic-stats reports to stderr, after the program's output
+echo "Running bytecode compiler on lists.feeny with --ic-stats"
+../bin/cfeeny -f --ic-stats ./lists.feeny > ../output/bytecode_compiler/lists_ic_stats.out 2> ../output/bytecode_compiler/lists_ic_stats.err
+same_output lists lists_ic_stats.out
+has_report ../output/bytecode_compiler/lists_ic_stats.err "=== Inline Cache Statistics ==="
+
+# --profile reports per method to stderr
+echo "Running bytecode compiler on lists.feeny with --profile"
+../bin/cfeeny -f --profile ./lists.feeny > ../output/bytecode_compiler/lists_profile.out 2> ../output/bytecode_compiler/lists_profile.err
+same_output lists lists_profile.out
+has_report ../output/bytecode_compiler/lists_profile.err "=== Profile ==="
+
+# --sample writes folded stacks, one "<entry>:line;...;method:line count" per line
+echo "Running bytecode compiler on generations.feeny with --sample"
+rm -f ../output/bytecode_compiler/generations.folded
+../bin/cfeeny -f --sample ../output/bytecode_compiler/generations.folded --sample-interval 1000 ./generations.feeny > ../output/bytecode_compiler/generations_sample.out
+same_output generations generations_sample.out
+has_report ../output/bytecode_compiler/generations.folded "^<entry>:[0-9]*;.* [0-9]*$"
+
+exit $failed